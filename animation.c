@@ -0,0 +1,287 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * © 2016 Boris Faure
+ *
+ * animation.c: animated backgrounds, given as a directory of PNG frames.
+ *
+ * Frames are decoded by a separate thread into a small ring buffer, so that
+ * decoding never blocks key presses or PAM. When all frames fit into the ring
+ * buffer, they are decoded only once. Presenting a frame only redraws the
+ * background layer (see redraw_background()).
+ *
+ */
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <xcb/xcb.h>
+#include <ev.h>
+#include <cairo.h>
+
+#include "i3lock.h"
+#include "xcb.h"
+#include "unlock_indicator.h"
+#include "background.h"
+#include "animation.h"
+
+/* Number of decoded frames kept in memory at most. */
+#define RING_SIZE 16
+
+/* How often to check whether the display was turned off (in seconds). */
+#define DPMS_CHECK_INTERVAL 5.0
+
+/* Print frame statistics every that many presented frames. */
+#define STATS_INTERVAL 100
+
+extern bool debug_mode;
+extern struct ev_loop *main_loop;
+
+/* Frames per second, set with --animation-fps. */
+double animation_fps = 10;
+/* Maximum share of one CPU spent on the animation (decoding and drawing),
+ * set with --animation-cpu. */
+double animation_cpu = 0.1;
+
+static char **frame_paths;
+static int num_frames;
+
+struct slot {
+    /* Set by the decoder thread when the frame is decoded, cleared by the main
+     * loop when it is done with the frame. */
+    bool ready;
+    int frame;
+    /* NULL when the frame could not be decoded. */
+    cairo_surface_t *surface;
+};
+
+static struct slot ring[RING_SIZE];
+static int ring_size;
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ring_cond = PTHREAD_COND_INITIALIZER;
+/* Time the decoder thread spent since the last presented frame. */
+static double decode_time;
+
+static bool started;
+static animation_pause_t paused;
+static struct ev_timer *frame_timer;
+static struct ev_timer *dpms_timer;
+/* The DPMSInfo request sent on the previous tick of dpms_timer. */
+static xcb_dpms_info_cookie_t dpms_cookie;
+
+static cairo_surface_t *current;
+static int current_frame = -1;
+/* Frames are not presented before this time to stay within the CPU budget. */
+static ev_tstamp next_allowed;
+
+static unsigned int frames_shown;
+static unsigned int frames_dropped_budget;
+static unsigned int frames_dropped_late;
+
+static int filter_png(const struct dirent *entry) {
+    size_t len = strlen(entry->d_name);
+    return (len > 4 && strcasecmp(entry->d_name + len - 4, ".png") == 0);
+}
+
+/*
+ * Collects the frames (all PNG files of the given directory, in alphabetical
+ * order). Nothing is decoded yet.
+ *
+ */
+bool animation_init(const char *dir) {
+    struct dirent **entries;
+    int n;
+
+    if ((n = scandir(dir, &entries, filter_png, alphasort)) < 0) {
+        fprintf(stderr, "Could not read animation directory \"%s\"\n", dir);
+        return false;
+    }
+    if (n == 0) {
+        fprintf(stderr, "No PNG frames found in \"%s\"\n", dir);
+        free(entries);
+        return false;
+    }
+
+    frame_paths = calloc(n, sizeof(char *));
+    for (int i = 0; i < n; i++) {
+        if (frame_paths == NULL ||
+            asprintf(&frame_paths[num_frames], "%s/%s", dir, entries[i]->d_name) == -1) {
+            free(entries[i]);
+            continue;
+        }
+        num_frames++;
+        free(entries[i]);
+    }
+    free(entries);
+
+    ring_size = (num_frames < RING_SIZE ? num_frames : RING_SIZE);
+    DEBUG("animation: %d frames, caching %d\n", num_frames, ring_size);
+    return (num_frames > 0);
+}
+
+static void *decoder_thread(void *arg) {
+    for (int frame = 0;; frame = (frame + 1) % num_frames) {
+        struct slot *slot = &ring[frame % ring_size];
+
+        pthread_mutex_lock(&ring_lock);
+        /* When all frames fit into the ring, they stay decoded forever. */
+        if (ring_size == num_frames && slot->ready) {
+            pthread_mutex_unlock(&ring_lock);
+            break;
+        }
+        while (slot->ready)
+            pthread_cond_wait(&ring_cond, &ring_lock);
+        pthread_mutex_unlock(&ring_lock);
+
+        double start = ev_time();
+        cairo_surface_t *surface = load_image(frame_paths[frame]);
+
+        pthread_mutex_lock(&ring_lock);
+        slot->surface = surface;
+        slot->frame = frame;
+        slot->ready = true;
+        decode_time += ev_time() - start;
+        pthread_mutex_unlock(&ring_lock);
+    }
+    return NULL;
+}
+
+static void print_stats(void) {
+    DEBUG("animation: %u frames shown, %u dropped (CPU budget), %u dropped (not decoded in time)\n",
+          frames_shown, frames_dropped_budget, frames_dropped_late);
+}
+
+static void frame_cb(EV_P_ ev_timer *w, int revents) {
+    if (ev_now(main_loop) < next_allowed) {
+        frames_dropped_budget++;
+        return;
+    }
+
+    int frame = (current_frame + 1) % num_frames;
+    struct slot *slot = &ring[frame % ring_size];
+
+    pthread_mutex_lock(&ring_lock);
+    bool ready = (slot->ready && slot->frame == frame);
+    double cost = decode_time;
+    decode_time = 0;
+    pthread_mutex_unlock(&ring_lock);
+
+    if (!ready) {
+        frames_dropped_late++;
+        return;
+    }
+
+    ev_tstamp start = ev_time();
+    if (slot->surface != NULL) {
+        if (current != NULL)
+            cairo_surface_destroy(current);
+        current = cairo_surface_reference(slot->surface);
+        redraw_background();
+    }
+    current_frame = frame;
+
+    if (ring_size < num_frames) {
+        /* Hand the slot back to the decoder thread. */
+        pthread_mutex_lock(&ring_lock);
+        if (slot->surface != NULL)
+            cairo_surface_destroy(slot->surface);
+        slot->surface = NULL;
+        slot->ready = false;
+        pthread_cond_signal(&ring_cond);
+        pthread_mutex_unlock(&ring_lock);
+    }
+
+    /* Spending cost seconds at a budget of animation_cpu means we have to
+     * idle for cost / animation_cpu seconds in total. */
+    ev_now_update(main_loop);
+    cost += ev_now(main_loop) - start;
+    next_allowed = start + cost / animation_cpu;
+
+    if (++frames_shown % STATS_INTERVAL == 0)
+        print_stats();
+}
+
+static void update_timers(void) {
+    if (paused == 0 && !ev_is_active(frame_timer)) {
+        DEBUG("animation: resumed\n");
+        ev_timer_start(main_loop, frame_timer);
+    } else if (paused != 0 && ev_is_active(frame_timer)) {
+        DEBUG("animation: paused (reason 0x%x)\n", paused);
+        print_stats();
+        ev_timer_stop(main_loop, frame_timer);
+    }
+}
+
+/*
+ * Reads the answer to the DPMS query of the previous tick and sends the next
+ * one, so that the main loop never waits for the X server.
+ *
+ */
+static void dpms_cb(EV_P_ ev_timer *w, int revents) {
+    if (dpms_cookie.sequence != 0) {
+        int off = dpms_poll_off(conn, dpms_cookie);
+        /* Still no answer, keep waiting for it. */
+        if (off == -1)
+            return;
+        animation_set_paused(PAUSE_DPMS, off);
+    }
+
+    dpms_cookie = dpms_query(conn);
+}
+
+/*
+ * Starts decoding and presenting frames. Must be called after i3lock forked
+ * into the background, since the decoder thread would not survive fork().
+ *
+ */
+void animation_start(void) {
+    pthread_t thread;
+
+    if (started || num_frames == 0)
+        return;
+
+    if (pthread_create(&thread, NULL, decoder_thread, NULL) != 0) {
+        perror("pthread_create");
+        return;
+    }
+    pthread_detach(thread);
+    started = true;
+
+    frame_timer = calloc(sizeof(struct ev_timer), 1);
+    ev_timer_init(frame_timer, frame_cb, 0., 1.0 / animation_fps);
+    update_timers();
+
+    dpms_timer = calloc(sizeof(struct ev_timer), 1);
+    ev_timer_init(dpms_timer, dpms_cb, DPMS_CHECK_INTERVAL, DPMS_CHECK_INTERVAL);
+    ev_timer_start(main_loop, dpms_timer);
+    dpms_cookie = dpms_query(conn);
+}
+
+bool animation_running(void) {
+    return started;
+}
+
+/*
+ * Returns the frame to display, or NULL if no frame was decoded yet.
+ *
+ */
+cairo_surface_t *animation_frame(void) {
+    return current;
+}
+
+/*
+ * Pauses the animation as long as any pause reason is set. While paused, no
+ * frames are decoded or drawn.
+ *
+ */
+void animation_set_paused(animation_pause_t reason, bool pause) {
+    if (pause)
+        paused |= reason;
+    else
+        paused &= ~reason;
+
+    if (started)
+        update_timers();
+}
@@ -0,0 +1,15 @@
+#ifndef _ANIMATION_H
+#define _ANIMATION_H
+
+typedef enum {
+    PAUSE_OBSCURED = (1 << 0), /* the lock window is fully obscured */
+    PAUSE_DPMS = (1 << 1)      /* the display is turned off */
+} animation_pause_t;
+
+bool animation_init(const char *dir);
+void animation_start(void);
+bool animation_running(void);
+cairo_surface_t *animation_frame(void);
+void animation_set_paused(animation_pause_t reason, bool paused);
+
+#endif
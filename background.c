@@ -0,0 +1,421 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * © 2016 Boris Faure
+ *
+ * background.c: paints the background (color, image given with -i or the
+ *               current animation frame, and the per-output images given
+ *               with --image-output).
+ *
+ */
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <xcb/xcb.h>
+#include <ev.h>
+#include <cairo.h>
+
+#include "i3lock.h"
+#include "xinerama.h"
+#include "unlock_indicator.h"
+#include "background.h"
+#include "animation.h"
+
+extern bool debug_mode;
+extern struct ev_loop *main_loop;
+
+/* A Cairo surface containing the specified image (-i), if any. */
+extern cairo_surface_t *img;
+
+/* Whether the image should be tiled. */
+extern bool tile;
+
+/* The background color to use (in hex). */
+extern char color[7];
+
+/* A copy of an image in the X server, see native_surface. */
+struct native_cache {
+    /* The image the copy was made of. We hold a reference, so that a new
+     * image cannot end up at the same address. */
+    cairo_surface_t *src;
+    cairo_surface_t *native;
+};
+
+/* Cache for img. */
+static struct native_cache img_cache;
+
+/* An image which is only displayed on one output. */
+struct output_image {
+    /* The RandR name of the output, or NULL to match by index in
+     * xr_resolutions. */
+    char *name;
+    int index;
+
+    char *path;
+
+    /* Decoded while the output is connected, NULL otherwise. */
+    cairo_surface_t *img;
+    /* Set when decoding failed, so that we don’t retry on every update. */
+    bool failed;
+    struct native_cache cache;
+
+    /* Protected by decode_lock: set by the main loop when the image should
+     * be decoded, cleared by the decoder thread together with setting
+     * decoded, which the main loop picks up. */
+    bool decode;
+    bool decoded;
+    cairo_surface_t *decoded_img;
+};
+
+static struct output_image *output_images;
+static int num_output_images;
+
+/* Per-output images are decoded by a separate thread once i3lock forked, see
+ * output_images_thread. */
+static pthread_mutex_t decode_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool decode_threaded;
+static bool decode_running;
+static bool decode_again;
+static struct ev_async *decode_async;
+
+/*
+ * Decodes the given PNG file. Returns NULL (after printing why) when the image
+ * could not be loaded.
+ *
+ */
+cairo_surface_t *load_image(const char *path) {
+    cairo_surface_t *surface = cairo_image_surface_create_from_png(path);
+    if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
+        fprintf(stderr, "Could not load image \"%s\": %s\n",
+                path, cairo_status_to_string(cairo_surface_status(surface)));
+        cairo_surface_destroy(surface);
+        return NULL;
+    }
+    return surface;
+}
+
+/*
+ * Parses an --image-output argument of the form <output>:<path>, where
+ * <output> is either a RandR output name (e.g. DP-1) or the index of the
+ * screen. The image is not decoded yet.
+ *
+ */
+bool add_output_image(const char *spec) {
+    const char *sep = strchr(spec, ':');
+    if (sep == NULL || sep == spec || sep[1] == '\0')
+        return false;
+
+    struct output_image *new_images = realloc(output_images, (num_output_images + 1) * sizeof(struct output_image));
+    if (new_images == NULL)
+        return false;
+    output_images = new_images;
+
+    struct output_image *oi = &output_images[num_output_images++];
+    memset(oi, 0, sizeof(struct output_image));
+    oi->path = strdup(sep + 1);
+
+    char *end;
+    long index = strtol(spec, &end, 10);
+    if (end == sep && index >= 0) {
+        oi->index = index;
+    } else {
+        oi->name = strndup(spec, sep - spec);
+        xr_want_names = true;
+    }
+
+    return true;
+}
+
+/*
+ * Returns the Xinerama screen the image belongs to, or -1 if that output is
+ * not connected. Without Xinerama, the root window is screen 0.
+ *
+ */
+static int find_screen(struct output_image *oi) {
+    if (xr_screens == 0)
+        return (oi->name == NULL && oi->index == 0 ? 0 : -1);
+
+    for (int screen = 0; screen < xr_screens; screen++) {
+        if (oi->name == NULL) {
+            if (oi->index == screen)
+                return screen;
+        } else if (xr_names[screen] != NULL &&
+                   strcmp(oi->name, xr_names[screen]) == 0) {
+            return screen;
+        }
+    }
+    return -1;
+}
+
+static void native_cache_clear(struct native_cache *cache) {
+    if (cache->native != NULL)
+        cairo_surface_destroy(cache->native);
+    if (cache->src != NULL)
+        cairo_surface_destroy(cache->src);
+    cache->native = NULL;
+    cache->src = NULL;
+}
+
+static void set_source_color(cairo_t *ctx) {
+    char strgroups[3][3] = {{color[0], color[1], '\0'},
+                            {color[2], color[3], '\0'},
+                            {color[4], color[5], '\0'}};
+    uint32_t rgb16[3] = {(strtol(strgroups[0], NULL, 16)),
+                         (strtol(strgroups[1], NULL, 16)),
+                         (strtol(strgroups[2], NULL, 16))};
+    cairo_set_source_rgb(ctx, rgb16[0] / 255.0, rgb16[1] / 255.0, rgb16[2] / 255.0);
+}
+
+/*
+ * Returns a copy of src which lives in the X server. Converting and uploading
+ * the image happens only once, all later redraws are server-side copies.
+ *
+ * With flatten set, images with an alpha channel are composited onto the
+ * background color first, so that the copy is in the pixel format of the
+ * target of ctx (i.e. the root visual, which might be 16 or 30 bit). Without
+ * it, they are kept in a 32 bit ARGB pixmap, which the X server converts on
+ * every redraw. Opaque images are always in the root visual’s format.
+ *
+ */
+static cairo_surface_t *native_surface(cairo_t *ctx, struct native_cache *cache, cairo_surface_t *src, bool flatten) {
+    if (cache->src == src)
+        return cache->native;
+
+    native_cache_clear(cache);
+
+    int width = cairo_image_surface_get_width(src);
+    int height = cairo_image_surface_get_height(src);
+    bool alpha = (cairo_image_surface_get_format(src) == CAIRO_FORMAT_ARGB32);
+    cairo_content_t content = (alpha && !flatten ? CAIRO_CONTENT_COLOR_ALPHA : cairo_surface_get_content(cairo_get_target(ctx)));
+    cairo_surface_t *native = cairo_surface_create_similar(cairo_get_target(ctx), content, width, height);
+    if (cairo_surface_status(native) != CAIRO_STATUS_SUCCESS) {
+        cairo_surface_destroy(native);
+        return src;
+    }
+
+    cairo_t *native_ctx = cairo_create(native);
+    cairo_set_operator(native_ctx, CAIRO_OPERATOR_SOURCE);
+    if (alpha && flatten) {
+        set_source_color(native_ctx);
+        cairo_paint(native_ctx);
+        cairo_set_operator(native_ctx, CAIRO_OPERATOR_OVER);
+    }
+    cairo_set_source_surface(native_ctx, src, 0, 0);
+    cairo_paint(native_ctx);
+    cairo_destroy(native_ctx);
+
+    DEBUG("uploaded %dx%d image to the X server\n", width, height);
+    cache->src = cairo_surface_reference(src);
+    cache->native = native;
+    return native;
+}
+
+static void paint_image(cairo_t *ctx, cairo_surface_t *surface,
+                        int x, int y, int width, int height) {
+    cairo_set_source_surface(ctx, surface, x, y);
+    if (tile)
+        cairo_pattern_set_extend(cairo_get_source(ctx), CAIRO_EXTEND_REPEAT);
+    cairo_rectangle(ctx, x, y, width, height);
+    cairo_fill(ctx);
+}
+
+/*
+ * Paints the background color, image or animation frame, then the per-output
+ * images on top.
+ * Per-output images are only drawn once update_output_images() decoded them.
+ *
+ */
+void draw_background(cairo_t *ctx, uint32_t *resolution) {
+    /* Until its first frame is decoded, the animation falls back to -i. */
+    cairo_surface_t *base = animation_frame();
+    if (base == NULL)
+        base = img;
+
+    if (base == img) {
+        /* Animation frames are only drawn once, so only img is worth keeping
+         * in the X server. It is painted onto the background color, so it can
+         * be flattened. */
+        if (img != NULL)
+            base = native_surface(ctx, &img_cache, img, true);
+        else
+            native_cache_clear(&img_cache);
+    }
+
+    if (base) {
+        paint_image(ctx, base, 0, 0, resolution[0], resolution[1]);
+    } else {
+        set_source_color(ctx);
+        cairo_rectangle(ctx, 0, 0, resolution[0], resolution[1]);
+        cairo_fill(ctx);
+    }
+
+    for (int i = 0; i < num_output_images; i++) {
+        struct output_image *oi = &output_images[i];
+        int screen = find_screen(oi);
+
+        if (screen == -1 || oi->img == NULL)
+            continue;
+
+        /* Translucent per-output images are blended with the image (or
+         * animation frame) beneath them, so they keep their alpha channel. */
+        Rect r = {0, 0, resolution[0], resolution[1]};
+        if (xr_screens > 0)
+            r = xr_resolutions[screen];
+        paint_image(ctx, native_surface(ctx, &oi->cache, oi->img, false),
+                    r.x, r.y, r.width, r.height);
+    }
+}
+
+static void free_output_image(struct output_image *oi) {
+    if (oi->img != NULL) {
+        DEBUG("output of image \"%s\" disconnected, freeing it\n", oi->path);
+        cairo_surface_destroy(oi->img);
+        oi->img = NULL;
+        native_cache_clear(&oi->cache);
+    }
+    /* Retry when the output is plugged in again. */
+    oi->failed = false;
+}
+
+/*
+ * Decodes the images the main loop asked for, one after the other, and hands
+ * them over through decode_async.
+ *
+ */
+static void *output_images_thread(void *arg) {
+    for (int i = 0; i < num_output_images; i++) {
+        struct output_image *oi = &output_images[i];
+
+        pthread_mutex_lock(&decode_lock);
+        bool decode = oi->decode;
+        pthread_mutex_unlock(&decode_lock);
+        if (!decode)
+            continue;
+
+        DEBUG("decoding image \"%s\"\n", oi->path);
+        cairo_surface_t *surface = load_image(oi->path);
+
+        pthread_mutex_lock(&decode_lock);
+        oi->decode = false;
+        oi->decoded = true;
+        oi->decoded_img = surface;
+        pthread_mutex_unlock(&decode_lock);
+    }
+
+    ev_async_send(main_loop, decode_async);
+    return NULL;
+}
+
+static void start_decoding(void) {
+    pthread_t thread;
+
+    if (decode_running) {
+        /* The running thread might already be past the new images. */
+        decode_again = true;
+        return;
+    }
+
+    if (pthread_create(&thread, NULL, output_images_thread, NULL) != 0) {
+        perror("pthread_create");
+        return;
+    }
+    pthread_detach(thread);
+    decode_running = true;
+}
+
+/*
+ * Takes the images decoded by output_images_thread and redraws the background
+ * with them.
+ *
+ */
+static void output_images_decoded_cb(EV_P_ ev_async *w, int revents) {
+    bool changed = false;
+
+    pthread_mutex_lock(&decode_lock);
+    decode_running = false;
+    for (int i = 0; i < num_output_images; i++) {
+        struct output_image *oi = &output_images[i];
+        if (!oi->decoded)
+            continue;
+
+        oi->decoded = false;
+        if (oi->decoded_img == NULL) {
+            oi->failed = true;
+        } else if (find_screen(oi) == -1) {
+            /* Unplugged while it was being decoded. */
+            cairo_surface_destroy(oi->decoded_img);
+        } else {
+            oi->img = oi->decoded_img;
+            changed = true;
+        }
+        oi->decoded_img = NULL;
+    }
+    pthread_mutex_unlock(&decode_lock);
+
+    if (decode_again) {
+        decode_again = false;
+        start_decoding();
+    }
+
+    if (changed)
+        redraw_background();
+}
+
+/*
+ * Frees the images of outputs which disappeared and decodes those of outputs
+ * which are connected, so that drawing never waits for a PNG file. Until
+ * output_images_start() was called, images are decoded right away.
+ *
+ */
+void update_output_images(void) {
+    bool pending = false;
+
+    for (int i = 0; i < num_output_images; i++) {
+        struct output_image *oi = &output_images[i];
+        int screen = find_screen(oi);
+
+        if (screen == -1) {
+            free_output_image(oi);
+            continue;
+        }
+        if (oi->img != NULL || oi->failed)
+            continue;
+
+        if (!decode_threaded) {
+            DEBUG("decoding image \"%s\" for screen %d\n", oi->path, screen);
+            if ((oi->img = load_image(oi->path)) == NULL)
+                oi->failed = true;
+            continue;
+        }
+
+        pthread_mutex_lock(&decode_lock);
+        if (!oi->decoded && !oi->decode) {
+            oi->decode = true;
+            pending = true;
+        }
+        pthread_mutex_unlock(&decode_lock);
+    }
+
+    if (pending)
+        start_decoding();
+}
+
+/*
+ * Decodes per-output images in a separate thread from now on. Must be called
+ * after i3lock forked into the background, since the thread would not
+ * survive fork().
+ *
+ */
+void output_images_start(void) {
+    if (num_output_images == 0)
+        return;
+
+    decode_async = calloc(sizeof(struct ev_async), 1);
+    ev_async_init(decode_async, output_images_decoded_cb);
+    ev_async_start(main_loop, decode_async);
+    decode_threaded = true;
+
+    update_output_images();
+}
@@ -0,0 +1,10 @@
+#ifndef _BACKGROUND_H
+#define _BACKGROUND_H
+
+cairo_surface_t *load_image(const char *path);
+bool add_output_image(const char *spec);
+void draw_background(cairo_t *ctx, uint32_t *resolution);
+void update_output_images(void);
+void output_images_start(void);
+
+#endif
@@ -9,6 +9,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <pwd.h>
+#include <grp.h>
+#include <netdb.h>
 #include <sys/types.h>
 #include <string.h>
 #include <unistd.h>
@@ -16,13 +18,21 @@
 #include <stdint.h>
 #include <xcb/xcb.h>
 #include <xcb/xkb.h>
+#include <xcb/xinerama.h>
+#include <xcb/randr.h>
+#include <xcb/dpms.h>
 #include <err.h>
 #include <assert.h>
 #include <security/pam_appl.h>
 #include <getopt.h>
 #include <string.h>
 #include <ev.h>
-#include <sys/mman.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/wait.h>
+#if defined(__linux__)
+#include <sys/prctl.h>
+#endif
 #include <xkbcommon/xkbcommon.h>
 #include <xkbcommon/xkbcommon-compose.h>
 #include <xkbcommon/xkbcommon-x11.h>
@@ -35,6 +45,10 @@
 #include "unlock_indicator.h"
 #include "xinerama.h"
 #include "klok.h"
+#include "background.h"
+#include "animation.h"
+#include "secure.h"
+#include "trace.h"
 
 #define TSTAMP_N_SECS(n) (n * 1.0)
 #define TSTAMP_N_MINS(n) (60 * TSTAMP_N_SECS(n))
@@ -52,8 +66,24 @@ xcb_window_t win;
 static xcb_cursor_t cursor;
 static pam_handle_t *pam_handle;
 int input_position = 0;
+/* All buffers holding (parts of) the password come from the secure arena,
+ * see secure.c. Buffers are handed over by swapping pointers, so that the
+ * password is never copied on our side. */
+#define PASSWORD_SIZE 512
 /* Holds the password you enter (in UTF-8). */
-static char password[512];
+static char *password;
+/* The password being verified, handed over to auth_thread_func. */
+static char *auth_password;
+/* A password entered while another one was being verified, which is tried
+ * next if that one turns out wrong. */
+static char *queued_password;
+/* The UTF-8 of the key being pressed (or of the composed character). */
+#define KEYSTROKE_SIZE 128
+static char *keystroke;
+/* How many copies of the password we handed to PAM for the current attempt,
+ * see conv_callback. */
+static unsigned int password_copies;
+static bool attempt_queued = false;
 static bool beep = false;
 bool debug_mode = false;
 bool unlock_indicator = true;
@@ -63,25 +93,124 @@ struct ev_loop *main_loop;
 static struct ev_timer *clear_pam_wrong_timeout;
 static struct ev_timer *clear_indicator_timeout;
 static struct ev_timer *discard_passwd_timeout;
+static struct ev_timer *keymap_reload_timeout;
+static struct ev_timer *fail_delay_timeout;
+static struct ev_timer *grab_retry_timeout;
 extern unlock_state_t unlock_state;
 extern pam_state_t pam_state;
 int failed_attempts = 0;
 bool show_failed_attempts = false;
 bool klok_mode = false;
+bool per_output_pixmaps = false;
 extern char color_on[9];
 extern char color_off[9];
 extern char color_shadow[9];
 extern char *klok_font;
+extern double animation_fps;
+extern double animation_cpu;
 
 static struct xkb_state *xkb_state;
 static struct xkb_context *xkb_context;
 static struct xkb_keymap *xkb_keymap;
 static struct xkb_compose_table *xkb_compose_table;
 static struct xkb_compose_state *xkb_compose_state;
+
+/* The compose table is only loaded once the screen is locked, see
+ * compose_thread_func. */
+static const char *compose_locale;
+static enum {
+    COMPOSE_UNLOADED,
+    COMPOSE_LOADING,
+    COMPOSE_LOADED,
+} compose_state;
+static pthread_t compose_thread;
+static struct ev_async *compose_async;
 static uint8_t xkb_base_event;
 static uint8_t xkb_base_error;
 
+/* Keysym and UTF-8 translation of the keycodes in the current keyboard state,
+ * filled lazily on key presses. An entry is only valid if its generation
+ * matches key_cache_generation, which is bumped whenever the keymap or the
+ * modifier state changes. */
+static struct key_cache_entry {
+    uint32_t generation;
+    xkb_keysym_t ksym;
+    int n;
+    char utf8[8];
+} *key_cache;
+#define KEY_CACHE_SIZE 256
+static uint32_t key_cache_generation = 1;
+static xkb_mod_index_t ctrl_mod_index = XKB_MOD_INVALID;
+static bool ctrl_active;
+
+/* Compiled keymaps by a hash of the keyboard description the X server sent,
+ * so that switching back and forth between layouts does not compile the same
+ * keymaps over and over. */
+#define KEYMAP_CACHE_SIZE 4
+static struct {
+    uint64_t hash;
+    struct xkb_keymap *keymap;
+} keymap_cache[KEYMAP_CACHE_SIZE];
+static int keymap_cache_next;
+static unsigned int keymap_compiles;
+static unsigned int keymap_cache_hits;
+
+/* Image reloading on SIGHUP, see image_reload_thread. */
+static pthread_mutex_t image_reload_lock = PTHREAD_MUTEX_INITIALIZER;
+static cairo_surface_t *reloaded_img;
+static bool image_reload_running;
+static bool image_reload_again;
+static bool image_reload_postponed;
+static struct ev_async *image_reload_async;
+
+/* Authentication runs in a separate thread, see auth_thread_func. */
+static pthread_t auth_thread;
+static int auth_result;
+static struct ev_async *auth_async;
+/* The delay (in microseconds) PAM modules asked for after the failed attempt,
+ * see fail_delay. */
+static unsigned int auth_fail_delay;
+static ev_tstamp auth_started;
+
+/* Grabbing pointer and keyboard, see try_grab. */
+static double grab_timeout = 3;
+static ev_tstamp grab_started;
+static ev_tstamp grab_backoff = 0.001;
+static int grab_attempts;
+static bool grabbed = false;
+static bool mapped = false;
+/* Set once the screen is locked and we daemonized, see lock_established.
+ * Threads do not survive fork(), so none may be started before. */
+static bool locked = false;
+
+/* With --fast-lock, the lock window is mapped in a solid color first, and the
+ * image and the klok are only drawn once the screen is locked, see
+ * start_final_frame. */
+static bool fast_lock = false;
+static bool final_frame_pending = false;
+static bool klok_deferred = false;
+
+/* Whether to report the duration of the startup phases, see trace.c. */
+bool trace_startup = false;
+
+/* Whether to warm up name service lookups once locked, see prewarm_func. */
+static bool pam_prewarm = false;
+static char *auth_username;
+
+/* Additional PAM services (e.g. for fingerprint readers), which authenticate
+ * in the background while the password is typed, each in a helper process,
+ * see background_auth_process. */
+struct background_auth {
+    const char *service;
+    pid_t pid;
+    struct ev_child child_watcher;
+};
+static struct background_auth *background_auths;
+static int num_background_auths;
+
 cairo_surface_t *img = NULL;
+/* Path of the image specified with -i, kept around to reload it on SIGHUP. */
+static char *image_path = NULL;
 bool tile = false;
 bool ignore_empty_password = false;
 bool skip_repeated_empty_password = false;
@@ -97,11 +226,140 @@ void u8_dec(char *s, int *i) {
     (void)(isutf(s[--(*i)]) || isutf(s[--(*i)]) || isutf(s[--(*i)]) || --(*i));
 }
 
+/*
+ * Drops the cached key translations, to be called after the keymap or the
+ * keyboard state changed. Also computes whether Ctrl is held down, so that
+ * key presses don’t need to look up the modifier.
+ *
+ */
+static void invalidate_key_cache(void) {
+    key_cache_generation++;
+    ctrl_active = (ctrl_mod_index != XKB_MOD_INVALID &&
+                   xkb_state_mod_index_is_active(xkb_state, ctrl_mod_index, XKB_STATE_MODS_DEPRESSED) > 0);
+}
+
+/*
+ * Returns the keysym and UTF-8 translation of the given keycode in the
+ * current keyboard state.
+ *
+ */
+static const struct key_cache_entry *lookup_key(xcb_keycode_t keycode) {
+    struct key_cache_entry *key = &key_cache[keycode];
+
+    if (key->generation == key_cache_generation)
+        return key;
+
+    key->ksym = xkb_state_key_get_one_sym(xkb_state, keycode);
+    /* The buffer will be null-terminated, so n >= 2 for 1 actual character. */
+    key->n = xkb_keysym_to_utf8(key->ksym, key->utf8, sizeof(key->utf8));
+    if (key->n < 0)
+        key->n = 0;
+    key->generation = key_cache_generation;
+    return key;
+}
+
+/*
+ * Replaces the keyboard state with the current one of the X server, keeping
+ * the keymap.
+ *
+ */
+static void sync_keyboard_state(void) {
+    struct xkb_state *new_state =
+        xkb_x11_state_new_from_device(xkb_keymap, conn, xkb_x11_get_core_keyboard_device_id(conn));
+    trace_round_trips(2);
+    if (new_state == NULL) {
+        fprintf(stderr, "[i3lock] xkb_x11_state_new_from_device failed\n");
+        return;
+    }
+
+    xkb_state_unref(xkb_state);
+    xkb_state = new_state;
+    invalidate_key_cache();
+}
+
+/*
+ * Feeds an XKB reply into an FNV-1a hash and frees it.
+ *
+ */
+static uint64_t hash_reply(uint64_t hash, void *reply) {
+    const uint8_t *data = reply;
+
+    if (reply == NULL)
+        return hash;
+
+    /* Skip the sequence number, which differs every time. */
+    size_t len = 32 + 4 * ((xcb_generic_reply_t *)reply)->length;
+    for (size_t i = 4; i < len; i++) {
+        hash ^= data[i];
+        hash *= 1099511628211ULL;
+    }
+    free(reply);
+    return hash;
+}
+
+/*
+ * Hashes the parts of the keyboard description which xkbcommon builds the
+ * keymap from. All requests are sent before waiting for any reply, so this
+ * costs one round-trip.
+ *
+ */
+static uint64_t hash_keyboard(int32_t device_id) {
+    static const xcb_xkb_map_part_t map_parts =
+        (XCB_XKB_MAP_PART_KEY_TYPES |
+         XCB_XKB_MAP_PART_KEY_SYMS |
+         XCB_XKB_MAP_PART_MODIFIER_MAP |
+         XCB_XKB_MAP_PART_EXPLICIT_COMPONENTS |
+         XCB_XKB_MAP_PART_KEY_ACTIONS |
+         XCB_XKB_MAP_PART_KEY_BEHAVIORS |
+         XCB_XKB_MAP_PART_VIRTUAL_MODS |
+         XCB_XKB_MAP_PART_VIRTUAL_MOD_MAP);
+    static const uint32_t name_details =
+        (XCB_XKB_NAME_DETAIL_KEYCODES |
+         XCB_XKB_NAME_DETAIL_SYMBOLS |
+         XCB_XKB_NAME_DETAIL_TYPES |
+         XCB_XKB_NAME_DETAIL_COMPAT |
+         XCB_XKB_NAME_DETAIL_KEY_TYPE_NAMES |
+         XCB_XKB_NAME_DETAIL_KT_LEVEL_NAMES |
+         XCB_XKB_NAME_DETAIL_INDICATOR_NAMES |
+         XCB_XKB_NAME_DETAIL_KEY_NAMES |
+         XCB_XKB_NAME_DETAIL_KEY_ALIASES |
+         XCB_XKB_NAME_DETAIL_VIRTUAL_MOD_NAMES |
+         XCB_XKB_NAME_DETAIL_GROUP_NAMES);
+    static const uint8_t all_groups =
+        (XCB_XKB_SET_OF_GROUP_GROUP_1 |
+         XCB_XKB_SET_OF_GROUP_GROUP_2 |
+         XCB_XKB_SET_OF_GROUP_GROUP_3 |
+         XCB_XKB_SET_OF_GROUP_GROUP_4);
+
+    xcb_xkb_get_map_cookie_t map = xcb_xkb_get_map(
+        conn, device_id, map_parts, 0,
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    xcb_xkb_get_compat_map_cookie_t compat =
+        xcb_xkb_get_compat_map(conn, device_id, all_groups, 1, 0, 0);
+    xcb_xkb_get_names_cookie_t names =
+        xcb_xkb_get_names(conn, device_id, name_details);
+    xcb_xkb_get_indicator_map_cookie_t indicators =
+        xcb_xkb_get_indicator_map(conn, device_id, 0xffffffff);
+
+    uint64_t hash = 14695981039346656037ULL;
+    hash = hash_reply(hash, xcb_xkb_get_map_reply(conn, map, NULL));
+    hash = hash_reply(hash, xcb_xkb_get_compat_map_reply(conn, compat, NULL));
+    hash = hash_reply(hash, xcb_xkb_get_names_reply(conn, names, NULL));
+    hash = hash_reply(hash, xcb_xkb_get_indicator_map_reply(conn, indicators, NULL));
+    trace_round_trips(1);
+    return hash;
+}
+
 /*
  * Loads the XKB keymap from the X11 server and feeds it to xkbcommon.
  * Necessary so that we can properly let xkbcommon track the keyboard state and
  * translate keypresses to utf-8.
  *
+ * Keymaps which were compiled before are reused when the X server describes
+ * the keyboard exactly like it did then. Hashing that description fetches
+ * about as much as compiling does, so the first keymap is compiled without
+ * it: there is nothing to reuse yet, and startup should not wait for it.
+ *
  */
 static bool load_keymap(void) {
     if (xkb_context == NULL) {
@@ -111,36 +369,75 @@ static bool load_keymap(void) {
         }
     }
 
-    xkb_keymap_unref(xkb_keymap);
-
+    ev_tstamp start = ev_time();
     int32_t device_id = xkb_x11_get_core_keyboard_device_id(conn);
+    trace_round_trips(1);
     DEBUG("device = %d\n", device_id);
-    if ((xkb_keymap = xkb_x11_keymap_new_from_device(xkb_context, conn, device_id, 0)) == NULL) {
-        fprintf(stderr, "[i3lock] xkb_x11_keymap_new_from_device failed\n");
-        return false;
+
+    const bool hashed = (xkb_keymap != NULL);
+    uint64_t hash = (hashed ? hash_keyboard(device_id) : 0);
+    struct xkb_keymap *keymap = NULL;
+    for (int i = 0; hashed && i < KEYMAP_CACHE_SIZE; i++) {
+        if (keymap_cache[i].keymap != NULL && keymap_cache[i].hash == hash) {
+            keymap = xkb_keymap_ref(keymap_cache[i].keymap);
+            break;
+        }
+    }
+
+    const bool cached = (keymap != NULL);
+    if (cached) {
+        keymap_cache_hits++;
+    } else {
+        /* Counted as one, although xkbcommon-x11 might need more (e.g. to
+         * look up atom names). */
+        keymap = xkb_x11_keymap_new_from_device(xkb_context, conn, device_id, 0);
+        trace_round_trips(1);
+        if (keymap == NULL) {
+            fprintf(stderr, "[i3lock] xkb_x11_keymap_new_from_device failed\n");
+            return false;
+        }
+        keymap_compiles++;
+    }
+
+    if (!cached && hashed) {
+        xkb_keymap_unref(keymap_cache[keymap_cache_next].keymap);
+        keymap_cache[keymap_cache_next].keymap = xkb_keymap_ref(keymap);
+        keymap_cache[keymap_cache_next].hash = hash;
+        keymap_cache_next = (keymap_cache_next + 1) % KEYMAP_CACHE_SIZE;
     }
 
     struct xkb_state *new_state =
-        xkb_x11_state_new_from_device(xkb_keymap, conn, device_id);
+        xkb_x11_state_new_from_device(keymap, conn, device_id);
+    trace_round_trips(1);
     if (new_state == NULL) {
         fprintf(stderr, "[i3lock] xkb_x11_state_new_from_device failed\n");
+        xkb_keymap_unref(keymap);
         return false;
     }
 
+    xkb_keymap_unref(xkb_keymap);
+    xkb_keymap = keymap;
     xkb_state_unref(xkb_state);
     xkb_state = new_state;
 
+    DEBUG("keymap %s in %.2f ms (%u compiled, %u reused so far)\n",
+          (cached ? "reused" : "compiled"), (ev_time() - start) * 1000,
+          keymap_compiles, keymap_cache_hits);
+
+    ctrl_mod_index = xkb_keymap_mod_get_index(xkb_keymap, XKB_MOD_NAME_CTRL);
+    invalidate_key_cache();
+
     return true;
 }
 
 /*
- * Loads the XKB compose table from the given locale.
+ * Uses the given XKB compose table, which may be NULL if loading it failed.
  *
  */
-static bool load_compose_table(const char *locale) {
+static bool use_compose_table(struct xkb_compose_table *table) {
     xkb_compose_table_unref(xkb_compose_table);
 
-    if ((xkb_compose_table = xkb_compose_table_new_from_locale(xkb_context, locale, 0)) == NULL) {
+    if ((xkb_compose_table = table) == NULL) {
         fprintf(stderr, "[i3lock] xkb_compose_table_new_from_locale failed\n");
         return false;
     }
@@ -157,16 +454,168 @@ static bool load_compose_table(const char *locale) {
     return true;
 }
 
+/*
+ * Parses the compose table in a separate thread, so that reading the (big)
+ * Compose file of the locale does not delay locking. It uses its own xkb
+ * context, as contexts must not be shared between threads.
+ *
+ */
+static void *compose_thread_func(void *arg) {
+    struct xkb_context *context = xkb_context_new(0);
+    struct xkb_compose_table *table = NULL;
+
+    if (context != NULL) {
+        table = xkb_compose_table_new_from_locale(context, compose_locale, 0);
+        xkb_context_unref(context);
+    }
+
+    ev_async_send(main_loop, compose_async);
+    return table;
+}
+
+static void start_compose_loading(void) {
+    if (compose_state != COMPOSE_UNLOADED)
+        return;
+
+    if (pthread_create(&compose_thread, NULL, compose_thread_func, NULL) != 0) {
+        perror("pthread_create");
+        return;
+    }
+    compose_state = COMPOSE_LOADING;
+}
+
+/*
+ * Makes sure the compose table is in use, waiting for the thread parsing it
+ * (or parsing it right away if the thread was not started yet).
+ *
+ */
+static void finish_compose_loading(void) {
+    struct xkb_compose_table *table = NULL;
+
+    switch (compose_state) {
+        case COMPOSE_UNLOADED:
+            table = xkb_compose_table_new_from_locale(xkb_context, compose_locale, 0);
+            break;
+        case COMPOSE_LOADING:
+            pthread_join(compose_thread, (void **)&table);
+            break;
+        case COMPOSE_LOADED:
+            return;
+    }
+    compose_state = COMPOSE_LOADED;
+    (void)use_compose_table(table);
+    DEBUG("compose table for \"%s\" loaded\n", compose_locale);
+}
+
+static void compose_loaded_cb(EV_P_ ev_async *w, int revents) {
+    finish_compose_loading();
+}
+
+/*
+ * Whether the keysym may start a compose sequence: the compose key or a dead
+ * key (keysyms 0xfe50 to 0xfe9f).
+ *
+ */
+static bool starts_compose(xkb_keysym_t ksym) {
+    return (ksym == XKB_KEY_Multi_key || (ksym >= 0xfe50 && ksym <= 0xfe9f));
+}
+
+static void finish_final_frame(void);
+
+/*
+ * Runs in a separate thread so that decoding a (big) image does not block
+ * key presses or PAM. The result is handed over to the main loop, which is the
+ * only place where img is ever touched.
+ *
+ */
+static void *image_reload_thread(void *arg) {
+    cairo_surface_t *surface = load_image(image_path);
+
+    pthread_mutex_lock(&image_reload_lock);
+    if (reloaded_img != NULL)
+        cairo_surface_destroy(reloaded_img);
+    reloaded_img = surface;
+    pthread_mutex_unlock(&image_reload_lock);
+
+    ev_async_send(main_loop, image_reload_async);
+    return NULL;
+}
+
+static void start_image_reload(void) {
+    pthread_t thread;
+
+    if (image_reload_running) {
+        /* The file might have changed again since the running thread opened
+         * it, so decode it once more when that thread is done. */
+        image_reload_again = true;
+        return;
+    }
+
+    DEBUG("reloading image \"%s\"\n", image_path);
+    if (pthread_create(&thread, NULL, image_reload_thread, NULL) != 0) {
+        perror("pthread_create");
+        return;
+    }
+    pthread_detach(thread);
+    image_reload_running = true;
+}
+
+/*
+ * Swaps in the image decoded by image_reload_thread. When decoding failed, we
+ * keep displaying the old image.
+ *
+ */
+static void image_reload_done_cb(EV_P_ ev_async *w, int revents) {
+    cairo_surface_t *surface;
+
+    pthread_mutex_lock(&image_reload_lock);
+    surface = reloaded_img;
+    reloaded_img = NULL;
+    pthread_mutex_unlock(&image_reload_lock);
+
+    image_reload_running = false;
+
+    if (surface != NULL) {
+        if (img != NULL)
+            cairo_surface_destroy(img);
+        img = surface;
+        if (!final_frame_pending)
+            redraw_screen();
+    }
+
+    if (final_frame_pending)
+        finish_final_frame();
+
+    if (image_reload_again) {
+        image_reload_again = false;
+        start_image_reload();
+    }
+}
+
+static void sighup_cb(EV_P_ ev_signal *w, int revents) {
+    if (image_path == NULL)
+        return;
+
+    /* The decoder thread would not survive the fork in lock_established,
+     * which reloads the image instead. */
+    if (!locked) {
+        image_reload_postponed = true;
+        return;
+    }
+
+    start_image_reload();
+}
+
 /*
  * Clears the memory which stored the password to be a bit safer against
  * cold-boot attacks.
  *
  */
-static void clear_password_memory(void) {
+static void clear_memory(char *buf, size_t size) {
     /* A volatile pointer to the password buffer to prevent the compiler from
      * optimizing this out. */
-    volatile char *vpassword = password;
-    for (int c = 0; c < sizeof(password); c++)
+    volatile char *vpassword = buf;
+    for (int c = 0; c < size; c++)
         /* We store a non-random pattern which consists of the (irrelevant)
          * index plus (!) the value of the beep variable. This prevents the
          * compiler from optimizing the calls away, since the value of 'beep'
@@ -174,6 +623,16 @@ static void clear_password_memory(void) {
         vpassword[c] = c + (int)beep;
 }
 
+static void swap_buffers(char **a, char **b) {
+    char *tmp = *a;
+    *a = *b;
+    *b = tmp;
+}
+
+static void clear_password_memory(void) {
+    clear_memory(password, PASSWORD_SIZE);
+}
+
 ev_timer *start_timer(ev_timer *timer_obj, ev_tstamp timeout, ev_callback_t callback) {
     if (timer_obj) {
         ev_timer_stop(main_loop, timer_obj);
@@ -199,6 +658,18 @@ ev_timer *stop_timer(ev_timer *timer_obj) {
     return NULL;
 }
 
+/*
+ * Forgets what was shown about the last failed attempt (the active
+ * modifiers), so that the next failure starts from scratch.
+ *
+ */
+static void clear_wrong_state(void) {
+    if (modifier_string != NULL) {
+        free(modifier_string);
+        modifier_string = NULL;
+    }
+}
+
 /*
  * Resets pam_state to STATE_PAM_IDLE 2 seconds after an unsuccessful
  * authentication event.
@@ -207,14 +678,9 @@ ev_timer *stop_timer(ev_timer *timer_obj) {
 static void clear_pam_wrong(EV_P_ ev_timer *w, int revents) {
     DEBUG("clearing pam wrong\n");
     pam_state = STATE_PAM_IDLE;
+    clear_wrong_state();
     redraw_screen();
 
-    /* Clear modifier string. */
-    if (modifier_string != NULL) {
-        free(modifier_string);
-        modifier_string = NULL;
-    }
-
     /* Now free this timeout. */
     STOP_TIMER(clear_pam_wrong_timeout);
 }
@@ -235,24 +701,153 @@ static void discard_passwd_cb(EV_P_ ev_timer *w, int revents) {
     STOP_TIMER(discard_passwd_timeout);
 }
 
-static void input_done(void) {
-    STOP_TIMER(clear_pam_wrong_timeout);
-    pam_state = STATE_PAM_VERIFY;
-    unlock_state = STATE_STARTED;
-    redraw_screen();
+#ifdef PAM_FAIL_DELAY
+/*
+ * Called by PAM instead of sleeping for the delay modules like pam_unix or
+ * pam_faildelay request after a failed attempt. The delay is enforced by the
+ * event loop instead (see auth_done), so that the failure is shown at once.
+ *
+ */
+static void fail_delay(int retval, unsigned usec_delay, void *appdata_ptr) {
+    if (retval != PAM_SUCCESS)
+        auth_fail_delay = usec_delay;
+}
+#endif
 
-    if (pam_authenticate(pam_handle, 0) == PAM_SUCCESS) {
-        DEBUG("successfully authenticated\n");
-        clear_password_memory();
+/*
+ * Runs pam_authenticate() in a separate thread, so that slow PAM modules (LDAP,
+ * Kerberos, fail delays) do not block the event loop: the screen keeps being
+ * redrawn and X11 events keep being handled meanwhile. The conversation
+ * function reads the password from auth_password.
+ *
+ */
+static void *auth_thread_func(void *arg) {
+    auth_result = pam_authenticate(pam_handle, 0);
+    ev_async_send(main_loop, auth_async);
+    return NULL;
+}
+
+static void auth_done(int result);
+static void fail_delay_cb(EV_P_ ev_timer *w, int revents);
+static void start_queued_auth(void);
+static void unlock(pam_handle_t *handle);
+
+static void auth_done_cb(EV_P_ ev_async *w, int revents) {
+    if (pam_state != STATE_PAM_VERIFY)
+        return;
 
+    pthread_join(auth_thread, NULL);
+    auth_done(auth_result);
+}
+
+/*
+ * Ends the PAM transaction which authenticated the user (NULL when a
+ * background service did, its helper process ended it already), cancels the
+ * other ones and exits.
+ *
+ */
+static void unlock(pam_handle_t *handle) {
+    clear_password_memory();
+    clear_memory(auth_password, PASSWORD_SIZE);
+    clear_memory(queued_password, PASSWORD_SIZE);
+
+    if (handle != NULL) {
         /* PAM credentials should be refreshed, this will for example update any kerberos tickets.
          * Related to credentials pam_end() needs to be called to cleanup any temporary
          * credentials like kerberos /tmp/krb5cc_pam_* files which may of been left behind if the
          * refresh of the credentials failed. */
-        pam_setcred(pam_handle, PAM_REFRESH_CRED);
-        pam_end(pam_handle, PAM_SUCCESS);
+        pam_setcred(handle, PAM_REFRESH_CRED);
+        pam_end(handle, PAM_SUCCESS);
+    }
+
+    /* The background services are waiting in pam_authenticate() (e.g. for a
+     * finger), their helper processes are simply terminated. */
+    for (int i = 0; i < num_background_auths; i++) {
+        if (background_auths[i].pid > 0)
+            kill(background_auths[i].pid, SIGTERM);
+    }
+
+    if (handle != pam_handle && pam_state != STATE_PAM_VERIFY)
+        pam_end(pam_handle, PAM_ABORT);
+
+    /* The authentication thread might still be inside a PAM module, so we
+     * must not run atexit handlers and library destructors beneath it. */
+    _exit(EXIT_SUCCESS);
+}
+
+/*
+ * Starts verifying the password in auth_password.
+ *
+ */
+static void start_auth(void) {
+    auth_started = ev_time();
+    auth_fail_delay = 0;
+    password_copies = 0;
+    /* A type-ahead or queued attempt may start before clear_pam_wrong() ran,
+     * the previous failure is left behind either way. */
+    STOP_TIMER(clear_pam_wrong_timeout);
+    clear_wrong_state();
+    pam_state = STATE_PAM_VERIFY;
+    unlock_state = STATE_STARTED;
+    redraw_screen();
+
+    /* Authenticating right here would block the event loop, and with it
+     * raising the window, so the attempt fails instead. */
+    if (pthread_create(&auth_thread, NULL, auth_thread_func, NULL) != 0) {
+        perror("pthread_create");
+        auth_done(PAM_SYSTEM_ERR);
+    }
+}
+
+static void input_done(void) {
+    /* Hand the password over to the authentication thread. The input buffer
+     * starts over, keys typed during verification are kept for the next
+     * attempt. */
+    swap_buffers(&auth_password, &password);
+    clear_input();
+    start_auth();
+}
+
+/*
+ * Keeps the password entered while another one is being verified, to be
+ * tried as soon as that one failed.
+ *
+ */
+static void queue_input(void) {
+    DEBUG("queueing the next attempt\n");
+    clear_memory(queued_password, PASSWORD_SIZE);
+    swap_buffers(&queued_password, &password);
+    attempt_queued = true;
+    clear_input();
+}
+
+static void start_queued_auth(void) {
+    if (!attempt_queued)
+        return;
+
+    swap_buffers(&auth_password, &queued_password);
+    attempt_queued = false;
+    start_auth();
+}
+
+static void fail_delay_cb(EV_P_ ev_timer *w, int revents) {
+    STOP_TIMER(fail_delay_timeout);
+    start_queued_auth();
+}
+
+/*
+ * Handles the result of an authentication: exits on success, shows the
+ * failure otherwise.
+ *
+ */
+static void auth_done(int result) {
+    clear_memory(auth_password, PASSWORD_SIZE);
+    DEBUG("authentication took %.1f ms, %u copies of the password handed to PAM\n",
+          (ev_time() - auth_started) * 1000, password_copies);
 
-        exit(0);
+    if (result == PAM_SUCCESS) {
+        DEBUG("successfully authenticated\n");
+        unlock(pam_handle);
     }
 
     if (debug_mode)
@@ -295,7 +890,6 @@ static void input_done(void) {
 
     pam_state = STATE_PAM_WRONG;
     failed_attempts += 1;
-    clear_input();
     if (unlock_indicator)
         redraw_screen();
 
@@ -313,6 +907,179 @@ static void input_done(void) {
         xcb_bell(conn, 100);
         xcb_flush(conn);
     }
+
+    /* No attempt is accepted before the delay the PAM modules asked for is
+     * over. Otherwise, if the user already typed the next attempt, don’t make
+     * them wait for it. */
+    if (auth_fail_delay > 0) {
+        DEBUG("delaying the next attempt by %u ms\n", auth_fail_delay / 1000);
+        START_TIMER(fail_delay_timeout, auth_fail_delay / 1e6, fail_delay_cb);
+    } else {
+        start_queued_auth();
+    }
+}
+
+/*
+ * Callback function for the background PAM services. There is no password to
+ * give them, so prompts fail and messages only end up in the debug output.
+ *
+ */
+static int background_conv_callback(int num_msg, const struct pam_message **msg,
+                                    struct pam_response **resp, void *appdata_ptr) {
+    for (int c = 0; c < num_msg; c++) {
+        if (msg[c]->msg_style == PAM_PROMPT_ECHO_OFF ||
+            msg[c]->msg_style == PAM_PROMPT_ECHO_ON)
+            return PAM_CONV_ERR;
+
+        DEBUG("PAM service \"%s\": %s\n", (const char *)appdata_ptr, msg[c]->msg);
+    }
+
+    return PAM_SUCCESS;
+}
+
+/*
+ * Runs one of the background services in a helper process, which does not get
+ * the password: they are meant for modules which wait for something else (a
+ * finger, a smartcard). A service which fails is started again: right away if
+ * it waited for the user (e.g. a finger which did not match), with an
+ * increasing delay (up to a minute) if it fails immediately (e.g. because
+ * there is no reader). The process exits once the service succeeded, when it
+ * cannot be started at all, or when i3lock (parent) is gone.
+ *
+ */
+static void background_auth_process(struct background_auth *auth, pid_t parent) {
+    struct pam_conv conv = {background_conv_callback, (void *)auth->service};
+    pam_handle_t *handle;
+    unsigned int backoff = 1;
+    int ret;
+
+    /* Only unlock() terminates the helpers, they must not keep waiting for a
+     * finger when i3lock died in any other way. */
+#if defined(__linux__)
+    (void)prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+    if (getppid() != parent)
+        _exit(EXIT_FAILURE);
+
+    if ((ret = pam_start(auth->service, auth_username, &conv, &handle)) != PAM_SUCCESS) {
+        fprintf(stderr, "[i3lock] PAM service \"%s\": %s\n", auth->service, pam_strerror(handle, ret));
+        _exit(EXIT_FAILURE);
+    }
+    pam_set_item(handle, PAM_TTY, getenv("DISPLAY"));
+
+    while (true) {
+        time_t started = time(NULL);
+
+        if ((ret = pam_authenticate(handle, 0)) == PAM_SUCCESS) {
+            pam_setcred(handle, PAM_REFRESH_CRED);
+            pam_end(handle, PAM_SUCCESS);
+            _exit(EXIT_SUCCESS);
+        }
+
+        DEBUG("PAM service \"%s\": %s\n", auth->service, pam_strerror(handle, ret));
+        if (getppid() != parent)
+            _exit(EXIT_FAILURE);
+
+        if (time(NULL) - started > 5) {
+            backoff = 1;
+        } else {
+            sleep(backoff);
+            backoff = (backoff * 2 < 60 ? backoff * 2 : 60);
+        }
+    }
+}
+
+/*
+ * Unlocks once the helper process of a background service reports success.
+ *
+ */
+static void background_auth_done_cb(EV_P_ ev_child *w, int revents) {
+    struct background_auth *auth = w->data;
+
+    ev_child_stop(main_loop, w);
+    auth->pid = 0;
+
+    if (WIFEXITED(w->rstatus) && WEXITSTATUS(w->rstatus) == EXIT_SUCCESS) {
+        DEBUG("successfully authenticated with \"%s\"\n", auth->service);
+        unlock(NULL);
+    }
+
+    fprintf(stderr, "[i3lock] PAM service \"%s\" stopped (status %d)\n",
+            auth->service, w->rstatus);
+}
+
+/*
+ * Forks the helper processes of the background services. This happens before
+ * any other thread is started (see lock_established), so the helpers can
+ * safely use PAM.
+ *
+ */
+static void start_background_auths(void) {
+    pid_t parent = getpid();
+
+    for (int i = 0; i < num_background_auths; i++) {
+        struct background_auth *auth = &background_auths[i];
+
+        DEBUG("starting PAM service \"%s\" in the background\n", auth->service);
+        if ((auth->pid = fork()) == 0)
+            background_auth_process(auth, parent);
+        if (auth->pid < 0) {
+            perror("fork");
+            auth->pid = 0;
+            continue;
+        }
+
+        ev_child_init(&auth->child_watcher, background_auth_done_cb, auth->pid, 0);
+        auth->child_watcher.data = auth;
+        ev_child_start(main_loop, &auth->child_watcher);
+    }
+}
+
+/*
+ * The first authentication of a session is usually much slower than the
+ * following ones, because PAM modules look up the user through NSS (which
+ * may load NSS modules and connect to LDAP or SSSD) and resolve the host
+ * name (e.g. for Kerberos). This does the same lookups in the background,
+ * without authenticating, so that the caches are warm when the user is done
+ * typing. The PAM modules themselves are already loaded by pam_start().
+ *
+ */
+static void *prewarm_func(void *arg) {
+    ev_tstamp start = ev_time();
+    struct passwd pwbuf, *pw = NULL;
+    char buf[4096];
+
+    if (getpwnam_r(auth_username, &pwbuf, buf, sizeof(buf), &pw) == 0 && pw != NULL) {
+        gid_t groups[64];
+        int ngroups = sizeof(groups) / sizeof(*groups);
+        (void)getgrouplist(auth_username, pw->pw_gid, groups, &ngroups);
+    }
+
+    char hostname[256];
+    if (gethostname(hostname, sizeof(hostname)) == 0) {
+        struct addrinfo hints = {.ai_flags = AI_CANONNAME};
+        struct addrinfo *res;
+
+        hostname[sizeof(hostname) - 1] = '\0';
+        if (getaddrinfo(hostname, NULL, &hints, &res) == 0)
+            freeaddrinfo(res);
+    }
+
+    DEBUG("warmed up name service lookups in %.1f ms\n", (ev_time() - start) * 1000);
+    return NULL;
+}
+
+static void start_prewarm(void) {
+    pthread_t thread;
+
+    if (!pam_prewarm)
+        return;
+
+    if (pthread_create(&thread, NULL, prewarm_func, NULL) != 0) {
+        perror("pthread_create");
+        return;
+    }
+    pthread_detach(thread);
 }
 
 static void redraw_timeout(EV_P_ ev_timer *w, int revents) {
@@ -330,6 +1097,32 @@ static bool skip_without_validation(void) {
     return false;
 }
 
+static void keymap_reload_cb(EV_P_ ev_timer *w, int revents) {
+    STOP_TIMER(keymap_reload_timeout);
+    (void)load_keymap();
+}
+
+/*
+ * Keymap changes come in bursts (e.g. setxkbmap sends several notifications),
+ * so the keymap is only reloaded once they stopped for a bit.
+ *
+ */
+static void schedule_keymap_reload(void) {
+    START_TIMER(keymap_reload_timeout, TSTAMP_N_SECS(0.1), keymap_reload_cb);
+}
+
+/*
+ * Reloads the keymap right away if a reload is pending, so that keys are
+ * never translated with a keymap which was already replaced.
+ *
+ */
+static void flush_keymap_reload(void) {
+    if (keymap_reload_timeout == NULL)
+        return;
+    STOP_TIMER(keymap_reload_timeout);
+    (void)load_keymap();
+}
+
 /*
  * Handle key presses. Fixes state, then looks up the key symbol for the
  * given keycode, then looks up the key symbol (as UCS-2), converts it to
@@ -337,17 +1130,19 @@ static bool skip_without_validation(void) {
  *
  */
 static void handle_key_press(xcb_key_press_event_t *event) {
-    xkb_keysym_t ksym;
-    char buffer[128];
+    flush_keymap_reload();
+
+    const struct key_cache_entry *key = lookup_key(event->detail);
+    xkb_keysym_t ksym = key->ksym;
+    const char *buffer = keystroke;
     int n;
-    bool ctrl;
+    bool ctrl = ctrl_active;
     bool composed = false;
 
-    ksym = xkb_state_key_get_one_sym(xkb_state, event->detail);
-    ctrl = xkb_state_mod_name_is_active(xkb_state, XKB_MOD_NAME_CTRL, XKB_STATE_MODS_DEPRESSED);
-
-    /* The buffer will be null-terminated, so n >= 2 for 1 actual character. */
-    memset(buffer, '\0', sizeof(buffer));
+    /* Keys typed before the compose table is loaded are taken as they are,
+     * unless they start a compose sequence. */
+    if (compose_state != COMPOSE_LOADED && starts_compose(ksym))
+        finish_compose_loading();
 
     if (xkb_compose_state && xkb_compose_state_feed(xkb_compose_state, ksym) == XKB_COMPOSE_FEED_ACCEPTED) {
         switch (xkb_compose_state_get_status(xkb_compose_state)) {
@@ -358,7 +1153,7 @@ static void handle_key_press(xcb_key_press_event_t *event) {
             case XKB_COMPOSE_COMPOSED:
                 /* xkb_compose_state_get_utf8 doesn't include the terminating byte in the return value
              * as xkb_keysym_to_utf8 does. Adding one makes the variable n consistent. */
-                n = xkb_compose_state_get_utf8(xkb_compose_state, buffer, sizeof(buffer)) + 1;
+                n = xkb_compose_state_get_utf8(xkb_compose_state, keystroke, KEYSTROKE_SIZE) + 1;
                 ksym = xkb_compose_state_get_one_sym(xkb_compose_state);
                 composed = true;
                 break;
@@ -369,7 +1164,8 @@ static void handle_key_press(xcb_key_press_event_t *event) {
     }
 
     if (!composed) {
-        n = xkb_keysym_to_utf8(ksym, buffer, sizeof(buffer));
+        n = key->n;
+        buffer = key->utf8;
     }
 
     switch (ksym) {
@@ -380,14 +1176,21 @@ static void handle_key_press(xcb_key_press_event_t *event) {
             if (ksym == XKB_KEY_j && !ctrl)
                 break;
 
-            if (pam_state == STATE_PAM_WRONG)
-                return;
-
             if (skip_without_validation()) {
                 clear_input();
                 return;
             }
             password[input_position] = '\0';
+
+            /* Only one attempt is verified at a time, the next one waits for
+             * the result and for the delay after a failure (and replaces any
+             * attempt waiting already). */
+            if (pam_state == STATE_PAM_VERIFY || fail_delay_timeout != NULL) {
+                queue_input();
+                skip_repeated_empty_password = true;
+                return;
+            }
+
             unlock_state = STATE_KEY_PRESSED;
             redraw_screen();
             input_done();
@@ -404,6 +1207,9 @@ static void handle_key_press(xcb_key_press_event_t *event) {
                 ksym == XKB_KEY_Escape) {
                 DEBUG("C-u pressed\n");
                 clear_input();
+                /* Also take back an attempt waiting for verification. */
+                clear_memory(queued_password, PASSWORD_SIZE);
+                attempt_queued = false;
                 /* Hide the unlock indicator after a bit if the password buffer is
                  * empty. */
                 if (unlock_indicator) {
@@ -445,7 +1251,7 @@ static void handle_key_press(xcb_key_press_event_t *event) {
             return;
     }
 
-    if ((input_position + 8) >= sizeof(password))
+    if ((input_position + 8) >= PASSWORD_SIZE)
         return;
 
 #if 0
@@ -491,6 +1297,11 @@ static void handle_key_press(xcb_key_press_event_t *event) {
  */
 static void handle_visibility_notify(xcb_connection_t *conn,
                                      xcb_visibility_notify_event_t *event) {
+    /* No need to animate the background while nobody can see it. */
+    animation_set_paused(PAUSE_OBSCURED, event->state == XCB_VISIBILITY_FULLY_OBSCURED);
+
+    /* Authentication does not block the event loop (see auth_thread_func),
+     * so the window can be raised right away whenever it gets obscured. */
     if (event->state != XCB_VISIBILITY_UNOBSCURED) {
         uint32_t values[] = {XCB_STACK_MODE_ABOVE};
         xcb_configure_window(conn, event->window, XCB_CONFIG_WINDOW_STACK_MODE, values);
@@ -532,11 +1343,11 @@ static void process_xkb_event(xcb_generic_event_t *gevent) {
     switch (event->any.xkbType) {
         case XCB_XKB_NEW_KEYBOARD_NOTIFY:
             if (event->new_keyboard_notify.changed & XCB_XKB_NKN_DETAIL_KEYCODES)
-                (void)load_keymap();
+                schedule_keymap_reload();
             break;
 
         case XCB_XKB_MAP_NOTIFY:
-            (void)load_keymap();
+            schedule_keymap_reload();
             break;
 
         case XCB_XKB_STATE_NOTIFY:
@@ -547,6 +1358,7 @@ static void process_xkb_event(xcb_generic_event_t *gevent) {
                                   event->state_notify.baseGroup,
                                   event->state_notify.latchedGroup,
                                   event->state_notify.lockedGroup);
+            invalidate_key_cache();
             break;
     }
 }
@@ -561,7 +1373,9 @@ void handle_screen_resize(void) {
     xcb_get_geometry_cookie_t geomc;
     xcb_get_geometry_reply_t *geom;
     geomc = xcb_get_geometry(conn, screen->root);
-    if ((geom = xcb_get_geometry_reply(conn, geomc, 0)) == NULL)
+    geom = xcb_get_geometry_reply(conn, geomc, 0);
+    trace_round_trips(1);
+    if (geom == NULL)
         return;
 
     if (last_resolution[0] == geom->width &&
@@ -582,6 +1396,7 @@ void handle_screen_resize(void) {
     xcb_flush(conn);
 
     xinerama_query_screens();
+    update_output_images();
     redraw_screen();
 }
 
@@ -606,11 +1421,14 @@ static int conv_callback(int num_msg, const struct pam_message **msg,
             continue;
 
         /* return code is currently not used but should be set to zero */
-        resp[c]->resp_retcode = 0;
-        if ((resp[c]->resp = strdup(password)) == NULL) {
+        (*resp)[c].resp_retcode = 0;
+        /* PAM takes ownership of the response and free()s it, so this is the
+         * one copy of the password which cannot come from the arena. */
+        if (((*resp)[c].resp = strdup(auth_password)) == NULL) {
             perror("strdup");
             return 1;
         }
+        password_copies++;
     }
 
     return 0;
@@ -649,6 +1467,124 @@ static void maybe_close_sleep_lock_fd(void) {
     }
 }
 
+/*
+ * Draws the screen as it would have looked without --fast-lock. This is called
+ * once the image (if any) is decoded, see start_final_frame.
+ *
+ */
+static void finish_final_frame(void) {
+    final_frame_pending = false;
+
+    /* We are locked already, so a missing font must not make us exit. */
+    if (klok_deferred) {
+        klok_deferred = false;
+        if (klok_load_font()) {
+            klok_mode = true;
+            klok_add_timer();
+        } else {
+            fprintf(stderr, "[i3lock] Could not find the klok font \"%s\"\n", klok_font);
+        }
+    }
+
+    redraw_screen();
+    trace_phase("render");
+    trace_report("final frame", true);
+}
+
+/*
+ * With --fast-lock, only the solid color lock window was mapped before the
+ * grabs. Now that the screen is covered, decode the image in the background
+ * and draw the full screen once it is done.
+ *
+ */
+static void start_final_frame(void) {
+    final_frame_pending = true;
+    if (image_path != NULL)
+        start_image_reload();
+    else
+        finish_final_frame();
+}
+
+/*
+ * Called once the lock window is mapped and pointer and keyboard are grabbed,
+ * i.e. once the screen is locked.
+ *
+ */
+static void lock_established(void) {
+    trace_phase("mapped");
+    trace_report(fast_lock ? "covered" : "locked", !fast_lock);
+    maybe_close_sleep_lock_fd();
+    if (!dont_fork) {
+        /* After the first MapNotify, we never fork again. We don’t
+         * expect to get another MapNotify, but better be sure… */
+        dont_fork = true;
+
+        /* In the parent process, we exit */
+        if (fork() != 0)
+            exit(0);
+
+        ev_loop_fork(EV_DEFAULT);
+        secure_after_fork();
+    }
+    locked = true;
+
+    /* The helper processes of the background PAM services are forked while
+     * we are still single-threaded. */
+    start_background_auths();
+
+    /* Threads do not survive fork(), so only start decoding the animation
+     * and per-output images, parsing the compose table and warming up PAM
+     * now. */
+    animation_start();
+    output_images_start();
+    start_compose_loading();
+    start_prewarm();
+    if (fast_lock)
+        start_final_frame();
+    else if (image_reload_postponed)
+        start_image_reload();
+}
+
+static void try_grab(void);
+
+static void grab_retry_cb(EV_P_ ev_timer *w, int revents) {
+    STOP_TIMER(grab_retry_timeout);
+    try_grab();
+}
+
+/*
+ * Tries to grab pointer and keyboard. While another client (e.g. an open menu)
+ * holds a grab, we try again from the event loop with an exponential backoff
+ * (up to 100 ms between attempts), and give up after grab_timeout seconds.
+ *
+ */
+static void try_grab(void) {
+    grab_attempts++;
+    if (!grab_pointer_and_keyboard(conn, screen, cursor)) {
+        if (ev_time() - grab_started >= grab_timeout)
+            errx(EXIT_FAILURE, "Cannot grab pointer/keyboard");
+
+        START_TIMER(grab_retry_timeout, grab_backoff, grab_retry_cb);
+        if (grab_backoff < 0.1)
+            grab_backoff *= 2;
+        return;
+    }
+
+    DEBUG("grabbed pointer and keyboard after %.1f ms (%d attempts)\n",
+          (ev_time() - grab_started) * 1000, grab_attempts);
+    grabbed = true;
+
+    /* Sync the current modifier state. Since we first loaded the keymap, there
+     * might have been changes, but starting from now, we should get all key
+     * presses/releases due to having grabbed the keyboard. Changes of the
+     * keymap itself are announced by XKB events, see process_xkb_event. */
+    sync_keyboard_state();
+    trace_phase("grab");
+
+    if (mapped)
+        lock_established();
+}
+
 /*
  * Instead of polling the X connection socket we leave this to
  * xcb_poll_for_event() which knows better than we can ever know.
@@ -675,7 +1611,12 @@ static void xcb_check_cb(EV_P_ ev_check *w, int revents) {
 
         switch (type) {
             case XCB_KEY_PRESS:
-                handle_key_press((xcb_key_press_event_t *)event);
+                /* Until the screen is locked, keys are not meant for us (we
+                 * might get them without a grab, e.g. with PointerRoot focus).
+                 * Handling them could also start the authentication thread,
+                 * which would not survive the fork in lock_established. */
+                if (locked)
+                    handle_key_press((xcb_key_press_event_t *)event);
                 break;
 
             case XCB_VISIBILITY_NOTIFY:
@@ -683,18 +1624,9 @@ static void xcb_check_cb(EV_P_ ev_check *w, int revents) {
                 break;
 
             case XCB_MAP_NOTIFY:
-                maybe_close_sleep_lock_fd();
-                if (!dont_fork) {
-                    /* After the first MapNotify, we never fork again. We don’t
-                     * expect to get another MapNotify, but better be sure… */
-                    dont_fork = true;
-
-                    /* In the parent process, we exit */
-                    if (fork() != 0)
-                        exit(0);
-
-                    ev_loop_fork(EV_DEFAULT);
-                }
+                mapped = true;
+                if (grabbed)
+                    lock_established();
                 break;
 
             case XCB_CONFIGURE_NOTIFY:
@@ -710,66 +1642,9 @@ static void xcb_check_cb(EV_P_ ev_check *w, int revents) {
     }
 }
 
-/*
- * This function is called from a fork()ed child and will raise the i3lock
- * window when the window is obscured, even when the main i3lock process is
- * blocked due to PAM.
- *
- */
-static void raise_loop(xcb_window_t window) {
-    xcb_connection_t *conn;
-    xcb_generic_event_t *event;
-    int screens;
-
-    if ((conn = xcb_connect(NULL, &screens)) == NULL ||
-        xcb_connection_has_error(conn))
-        errx(EXIT_FAILURE, "Cannot open display\n");
-
-    /* We need to know about the window being obscured or getting destroyed. */
-    xcb_change_window_attributes(conn, window, XCB_CW_EVENT_MASK,
-                                 (uint32_t[]){
-                                     XCB_EVENT_MASK_VISIBILITY_CHANGE |
-                                     XCB_EVENT_MASK_STRUCTURE_NOTIFY});
-    xcb_flush(conn);
-
-    DEBUG("Watching window 0x%08x\n", window);
-    while ((event = xcb_wait_for_event(conn)) != NULL) {
-        if (event->response_type == 0) {
-            xcb_generic_error_t *error = (xcb_generic_error_t *)event;
-            DEBUG("X11 Error received! sequence 0x%x, error_code = %d\n",
-                  error->sequence, error->error_code);
-            free(event);
-            continue;
-        }
-        /* Strip off the highest bit (set if the event is generated) */
-        int type = (event->response_type & 0x7F);
-        DEBUG("Read event of type %d\n", type);
-        switch (type) {
-            case XCB_VISIBILITY_NOTIFY:
-                handle_visibility_notify(conn, (xcb_visibility_notify_event_t *)event);
-                break;
-            case XCB_UNMAP_NOTIFY:
-                DEBUG("UnmapNotify for 0x%08x\n", (((xcb_unmap_notify_event_t *)event)->window));
-                if (((xcb_unmap_notify_event_t *)event)->window == window)
-                    exit(EXIT_SUCCESS);
-                break;
-            case XCB_DESTROY_NOTIFY:
-                DEBUG("DestroyNotify for 0x%08x\n", (((xcb_destroy_notify_event_t *)event)->window));
-                if (((xcb_destroy_notify_event_t *)event)->window == window)
-                    exit(EXIT_SUCCESS);
-                break;
-            default:
-                DEBUG("Unhandled event type %d\n", type);
-                break;
-        }
-        free(event);
-    }
-}
-
 int main(int argc, char *argv[]) {
     struct passwd *pw;
     char *username;
-    char *image_path = NULL;
     int ret;
     struct pam_conv conv = {conv_callback, NULL};
     int curs_choice = CURS_NONE;
@@ -790,6 +1665,16 @@ int main(int argc, char *argv[]) {
         {"ignore-empty-password", no_argument, NULL, 'e'},
         {"inactivity-timeout", required_argument, NULL, 'I'},
         {"show-failed-attempts", no_argument, NULL, 'f'},
+        {"image-output", required_argument, NULL, 0},
+        {"per-output-pixmaps", no_argument, NULL, 0},
+        {"background-pam-service", required_argument, NULL, 0},
+        {"pam-prewarm", no_argument, NULL, 0},
+        {"grab-timeout", required_argument, NULL, 0},
+        {"trace-startup", no_argument, NULL, 0},
+        {"fast-lock", no_argument, NULL, 0},
+        {"animation-dir", required_argument, NULL, 0},
+        {"animation-fps", required_argument, NULL, 0},
+        {"animation-cpu", required_argument, NULL, 0},
         {"klok:on", required_argument, NULL, 0},
         {"klok:off", required_argument, NULL, 0},
         {"klok:shadow", required_argument, NULL, 0},
@@ -860,6 +1745,58 @@ int main(int argc, char *argv[]) {
                     debug_mode = true;
                     break;
                 }
+                if (strcmp(longopts[optind].name, "fast-lock") == 0) {
+                    fast_lock = true;
+                    break;
+                }
+                if (strcmp(longopts[optind].name, "trace-startup") == 0) {
+                    trace_startup = true;
+                    break;
+                }
+                if (strcmp(longopts[optind].name, "grab-timeout") == 0) {
+                    if (sscanf(optarg, "%lf", &grab_timeout) != 1 || grab_timeout < 0)
+                        errx(EXIT_FAILURE, "grab-timeout is invalid, it must be a number of seconds\n");
+                    break;
+                }
+                if (strcmp(longopts[optind].name, "pam-prewarm") == 0) {
+                    pam_prewarm = true;
+                    break;
+                }
+                if (strcmp(longopts[optind].name, "background-pam-service") == 0) {
+                    background_auths = realloc(background_auths, (num_background_auths + 1) * sizeof(struct background_auth));
+                    if (background_auths == NULL)
+                        err(EXIT_FAILURE, "realloc");
+                    memset(&background_auths[num_background_auths], 0, sizeof(struct background_auth));
+                    background_auths[num_background_auths].service = optarg;
+                    num_background_auths++;
+                    break;
+                }
+                if (strcmp(longopts[optind].name, "image-output") == 0) {
+                    if (!add_output_image(optarg))
+                        errx(EXIT_FAILURE, "image-output is invalid, it must be given as output:image.png\n");
+                    break;
+                }
+                if (strcmp(longopts[optind].name, "per-output-pixmaps") == 0) {
+                    per_output_pixmaps = true;
+                    break;
+                }
+                if (strcmp(longopts[optind].name, "animation-dir") == 0) {
+                    if (!animation_init(optarg))
+                        errx(EXIT_FAILURE, "Could not load animation frames from \"%s\"\n", optarg);
+                    break;
+                }
+                if (strcmp(longopts[optind].name, "animation-fps") == 0) {
+                    if (sscanf(optarg, "%lf", &animation_fps) != 1 || animation_fps <= 0)
+                        errx(EXIT_FAILURE, "animation-fps is invalid, it must be a positive number\n");
+                    break;
+                }
+                if (strcmp(longopts[optind].name, "animation-cpu") == 0) {
+                    int percent;
+                    if (sscanf(optarg, "%d", &percent) != 1 || percent <= 0 || percent > 100)
+                        errx(EXIT_FAILURE, "animation-cpu is invalid, it must be a percentage between 1 and 100\n");
+                    animation_cpu = percent / 100.0;
+                    break;
+                }
                 if (strcmp(longopts[optind].name, "klok:on") == 0) {
                     size_t len;
                     char *arg = optarg;
@@ -910,39 +1847,64 @@ int main(int argc, char *argv[]) {
                 break;
             default:
                 errx(EXIT_FAILURE, "Syntax: i3lock [-v] [-n] [-b] [-d] [-c color] [-u] [-p win|default]"
-                                   " [-i image.png] [-t] [-e] [-I timeout] [-f]"
+                                   " [-i image.png] [--image-output output:image.png] [--animation-dir dir] [--animation-fps fps] [--animation-cpu percent]"
+                                   " [--per-output-pixmaps] [--background-pam-service service] [--pam-prewarm] [--grab-timeout seconds] [--trace-startup] [--fast-lock] [-t] [-e] [-I timeout] [-f]"
                                    " [-k] [--klok:on color] [--klok:off color] [--klok:shadow] [--klok:font font_name]");
         }
     }
 
+    trace_start();
+
+    /* With --fast-lock, looking up the font is part of the final frame. */
+    if (klok_mode && fast_lock) {
+        klok_mode = false;
+        klok_deferred = true;
+    }
+
+    if (klok_mode && !klok_load_font())
+        errx(EXIT_FAILURE, "Could not find the klok font \"%s\"\n", klok_font);
+
     /* We need (relatively) random numbers for highlighting a random part of
      * the unlock indicator upon keypresses. */
     srand(time(NULL));
 
     /* Initialize PAM */
+    auth_username = strdup(username);
     if ((ret = pam_start("i3lock", username, &conv, &pam_handle)) != PAM_SUCCESS)
         errx(EXIT_FAILURE, "PAM: %s", pam_strerror(pam_handle, ret));
 
     if ((ret = pam_set_item(pam_handle, PAM_TTY, getenv("DISPLAY"))) != PAM_SUCCESS)
         errx(EXIT_FAILURE, "PAM: %s", pam_strerror(pam_handle, ret));
 
-/* Using mlock() as non-super-user seems only possible in Linux. Users of other
- * operating systems should use encrypted swap/no swap (or remove the ifdef and
- * run i3lock as super-user). */
-#if defined(__linux__)
-    /* Lock the area where we store the password in memory, we don’t want it to
-     * be swapped to disk. Since Linux 2.6.9, this does not require any
-     * privileges, just enough bytes in the RLIMIT_MEMLOCK limit. */
-    if (mlock(password, sizeof(password)) != 0)
-        err(EXIT_FAILURE, "Could not lock page in memory, check RLIMIT_MEMLOCK");
+#ifdef PAM_FAIL_DELAY
+    if ((ret = pam_set_item(pam_handle, PAM_FAIL_DELAY, (const void *)fail_delay)) != PAM_SUCCESS)
+        errx(EXIT_FAILURE, "PAM: %s", pam_strerror(pam_handle, ret));
 #endif
 
+    /* The key cache holds the translations of the keys which were pressed,
+     * which tells a lot about the password, so it is kept with it. */
+    secure_init(5, 3 * PASSWORD_SIZE + KEYSTROKE_SIZE +
+                       KEY_CACHE_SIZE * sizeof(struct key_cache_entry));
+    password = secure_alloc(PASSWORD_SIZE);
+    auth_password = secure_alloc(PASSWORD_SIZE);
+    queued_password = secure_alloc(PASSWORD_SIZE);
+    keystroke = secure_alloc(KEYSTROKE_SIZE);
+    key_cache = secure_alloc(KEY_CACHE_SIZE * sizeof(struct key_cache_entry));
+
     /* Double checking that connection is good and operatable with xcb */
     int screennr;
     if ((conn = xcb_connect(NULL, &screennr)) == NULL ||
         xcb_connection_has_error(conn))
         errx(EXIT_FAILURE, "Could not connect to X11, maybe you need to set DISPLAY?");
 
+    /* Ask for all extensions we use at once, instead of one round-trip each
+     * when they are first used. */
+    xcb_prefetch_extension_data(conn, &xcb_xkb_id);
+    xcb_prefetch_extension_data(conn, &xcb_xinerama_id);
+    xcb_prefetch_extension_data(conn, &xcb_randr_id);
+    xcb_prefetch_extension_data(conn, &xcb_dpms_id);
+    trace_phase("connect");
+
     if (xkb_x11_setup_xkb_extension(conn,
                                     XKB_X11_MIN_MAJOR_XKB_VERSION,
                                     XKB_X11_MIN_MINOR_XKB_VERSION,
@@ -952,6 +1914,8 @@ int main(int argc, char *argv[]) {
                                     &xkb_base_event,
                                     &xkb_base_error) != 1)
         errx(EXIT_FAILURE, "Could not setup XKB extension.");
+    /* The prefetched extension data, then XkbUseExtension. */
+    trace_round_trips(2);
 
     static const xcb_xkb_map_part_t required_map_parts =
         (XCB_XKB_MAP_PART_KEY_TYPES |
@@ -967,6 +1931,7 @@ int main(int argc, char *argv[]) {
          XCB_XKB_EVENT_TYPE_MAP_NOTIFY |
          XCB_XKB_EVENT_TYPE_STATE_NOTIFY);
 
+    trace_round_trips(1);
     xcb_xkb_select_events(
         conn,
         xkb_x11_get_core_keyboard_device_id(conn),
@@ -977,9 +1942,12 @@ int main(int argc, char *argv[]) {
         required_map_parts,
         0);
 
+    trace_phase("xkb");
+
     /* When we cannot initially load the keymap, we better exit */
     if (!load_keymap())
         errx(EXIT_FAILURE, "Could not load keymap");
+    trace_phase("keymap");
 
     const char *locale = getenv("LC_ALL");
     if (!locale)
@@ -991,13 +1959,13 @@ int main(int argc, char *argv[]) {
             fprintf(stderr, "Can't detect your locale, fallback to C\n");
         locale = "C";
     }
+    compose_locale = locale;
 
-    load_compose_table(locale);
+    screen = xcb_setup_roots_iterator(xcb_get_setup(conn)).data;
 
     xinerama_init();
     xinerama_query_screens();
-
-    screen = xcb_setup_roots_iterator(xcb_get_setup(conn)).data;
+    trace_phase("xinerama");
 
     last_resolution[0] = screen->width_in_pixels;
     last_resolution[1] = screen->height_in_pixels;
@@ -1005,44 +1973,31 @@ int main(int argc, char *argv[]) {
     xcb_change_window_attributes(conn, screen->root, XCB_CW_EVENT_MASK,
                                  (uint32_t[]){XCB_EVENT_MASK_STRUCTURE_NOTIFY});
 
-    if (image_path) {
-        /* Create a pixmap to render on, fill it with the background color */
-        img = cairo_image_surface_create_from_png(image_path);
+    if (image_path && !fast_lock) {
         /* In case loading failed, we just pretend no -i was specified. */
-        if (cairo_surface_status(img) != CAIRO_STATUS_SUCCESS) {
-            fprintf(stderr, "Could not load image \"%s\": %s\n",
-                    image_path, cairo_status_to_string(cairo_surface_status(img)));
-            img = NULL;
-        }
+        img = load_image(image_path);
     }
-
-    /* Pixmap on which the image is rendered to (if any) */
-    xcb_pixmap_t bg_pixmap = draw_image(last_resolution);
+    if (!fast_lock)
+        update_output_images();
+
+    /* Pixmap on which the image is rendered to (if any). With per-output
+     * pixmaps, the child windows of each output are drawn after the lock
+     * window exists. With --fast-lock, the window only gets its background
+     * color for now, see start_final_frame. */
+    xcb_pixmap_t bg_pixmap = XCB_NONE;
+    if (!use_output_windows() && !fast_lock)
+        bg_pixmap = draw_image(last_resolution);
+    trace_phase("image");
 
     /* open the fullscreen window, already with the correct pixmap in place */
     win = open_fullscreen_window(conn, screen, color, bg_pixmap);
-    xcb_free_pixmap(conn, bg_pixmap);
-
-    pid_t pid = fork();
-    /* The pid == -1 case is intentionally ignored here:
-     * While the child process is useful for preventing other windows from
-     * popping up while i3lock blocks, it is not critical. */
-    if (pid == 0) {
-        /* Child */
-        close(xcb_get_file_descriptor(conn));
-        maybe_close_sleep_lock_fd();
-        raise_loop(win);
-        exit(EXIT_SUCCESS);
-    }
+    if (bg_pixmap != XCB_NONE)
+        xcb_free_pixmap(conn, bg_pixmap);
+    else if (!fast_lock)
+        redraw_screen();
 
     cursor = create_cursor(conn, screen, win, curs_choice);
-
-    grab_pointer_and_keyboard(conn, screen, cursor);
-    /* Load the keymap again to sync the current modifier state. Since we first
-     * loaded the keymap, there might have been changes, but starting from now,
-     * we should get all key presses/releases due to having grabbed the
-     * keyboard. */
-    (void)load_keymap();
+    trace_phase("window");
 
     /* Initialize the libev event loop. */
     main_loop = EV_DEFAULT;
@@ -1062,12 +2017,34 @@ int main(int argc, char *argv[]) {
     ev_prepare_init(xcb_prepare, xcb_prepare_cb);
     ev_prepare_start(main_loop, xcb_prepare);
 
+    auth_async = calloc(sizeof(struct ev_async), 1);
+    ev_async_init(auth_async, auth_done_cb);
+    ev_async_start(main_loop, auth_async);
+
+    compose_async = calloc(sizeof(struct ev_async), 1);
+    ev_async_init(compose_async, compose_loaded_cb);
+    ev_async_start(main_loop, compose_async);
+
+    /* SIGHUP reloads the image instead of terminating (= unlocking). */
+    image_reload_async = calloc(sizeof(struct ev_async), 1);
+    ev_async_init(image_reload_async, image_reload_done_cb);
+    ev_async_start(main_loop, image_reload_async);
+
+    struct ev_signal *sighup_watcher = calloc(sizeof(struct ev_signal), 1);
+    ev_signal_init(sighup_watcher, sighup_cb, SIGHUP);
+    ev_signal_start(main_loop, sighup_watcher);
+
+    /* The screen is only locked once we hold the grabs, see lock_established. */
+    grab_started = ev_time();
+    try_grab();
+
     /* Invoke the event callback once to catch all the events which were
      * received up until now. ev will only pick up new events (when the X11
      * file descriptor becomes readable). */
     ev_invoke(main_loop, xcb_check, 0);
 
-    if (klok_mode)
+    /* With --fast-lock, the timer is added along with the final frame. */
+    if (klok_mode && !fast_lock)
         klok_add_timer();
     ev_loop(main_loop, 0);
 }
@@ -12,20 +12,32 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <math.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
 #include <xcb/xcb.h>
 #include <ev.h>
 #include <cairo.h>
 #include <cairo/cairo-xcb.h>
+#include <cairo/cairo-ft.h>
+#include <fontconfig/fontconfig.h>
+#if defined(__linux__)
+#include <sys/timerfd.h>
+#endif
 
 #include "i3lock.h"
 #include "unlock_indicator.h"
 #include "klok.h"
+#include "klok_words.h"
+#include "xinerama.h"
 
 extern bool debug_mode;
 extern struct ev_loop *main_loop;
 
-static double font_size;
+/* The current resolution of the X11 root window. */
+extern uint32_t last_resolution[2];
 
 static struct color {
     double r;
@@ -40,16 +52,65 @@ char color_shadow[9] = "0000007f";
 
 char *klok_font = "monospace";
 
+/* klok_font, resolved once by klok_load_font(). */
+static cairo_font_face_t *font_face;
+
 // 11x10 (WxH)
 struct letter {
     char letter[2];
     bool is_on;
 };
 
-#define NB_WIDTH 11
-#define NB_HEIGHT 10
 static struct letter letters[NB_HEIGHT][NB_WIDTH] = {};
 
+static const struct language *language = &klok_english;
+
+/* The words to turn on, for each five minute slot of the day. */
+static uint32_t slots[NB_SLOTS];
+
+/* Number of distinct output sizes (and font sizes) we keep layouts (and
+ * atlases) for. */
+#define NB_CACHED 4
+
+/* Font size and letter positions for one output size, only recomputed when
+ * the output size changes. Positions are relative to the output. */
+struct layout {
+    uint32_t resolution_w;
+    uint32_t resolution_h;
+    double font_size;
+    cairo_text_extents_t extents;
+    uint32_t off_x[NB_WIDTH];
+    uint32_t off_y[NB_HEIGHT];
+};
+
+static struct layout layouts[NB_CACHED];
+static int nb_layouts;
+
+#define NB_LETTERS 26
+
+/* All letters rendered with their shadow for one font size, off in the first
+ * row and on in the second one, so that drawing the grid is only copying.
+ * Outputs of the same size share one atlas. */
+struct atlas {
+    cairo_surface_t *surface;
+    double font_size;
+    int cell_w;
+    int cell_h;
+    /* Where the baseline of the letter starts within a cell. */
+    int origin_x;
+    int origin_y;
+};
+
+static struct atlas atlases[NB_CACHED];
+static int nb_atlases;
+
+/* The font face scaled to the font sizes in use. */
+static struct {
+    double font_size;
+    cairo_scaled_font_t *font;
+} scaled_fonts[NB_CACHED];
+static int nb_scaled_fonts;
+
 static int
 char_to_int(const char c)
 {
@@ -89,15 +150,112 @@ random_letter(void)
     return 'A' + rand() % ('Z'-'A');
 }
 
+/* Generic family names, which fontconfig resolves to whatever font is
+ * configured for them. */
+static const char *generic_families[] = {
+    "monospace", "sans-serif", "sans", "serif", "cursive", "fantasy",
+    "system-ui",
+};
+
+/* Resolves klok_font (in bold) to a font file once, instead of letting
+ * cairo’s toy font API match it on every redraw. Returns false if no font of
+ * that family is installed. */
+bool
+klok_load_font(void)
+{
+    FcPattern *pattern, *match;
+    FcResult result;
+    FcChar8 *family, *file = NULL;
+    char *requested = NULL;
+    ev_tstamp start = ev_time();
+    bool found = false;
+    size_t i;
+
+    if ((pattern = FcNameParse((const FcChar8 *)klok_font)) == NULL)
+        return false;
+    if (FcPatternGetString(pattern, FC_FAMILY, 0, &family) == FcResultMatch)
+        requested = strdup((const char *)family);
+    FcPatternAddInteger(pattern, FC_WEIGHT, FC_WEIGHT_BOLD);
+    FcConfigSubstitute(NULL, pattern, FcMatchPattern);
+    FcDefaultSubstitute(pattern);
+    match = FcFontMatch(NULL, pattern, &result);
+    FcPatternDestroy(pattern);
+    if (match == NULL) {
+        free(requested);
+        return false;
+    }
+
+    /* fontconfig always falls back to some font, only accept the match if
+     * it is of the requested family (or the requested family is generic). */
+    if (requested == NULL) {
+        found = true;
+    } else {
+        for (i = 0; i < sizeof(generic_families) / sizeof(*generic_families); i++) {
+            if (strcasecmp(requested, generic_families[i]) == 0)
+                found = true;
+        }
+        for (i = 0; !found && FcPatternGetString(match, FC_FAMILY, i, &family) == FcResultMatch; i++) {
+            if (strcasecmp(requested, (const char *)family) == 0)
+                found = true;
+        }
+    }
+    free(requested);
+
+    if (found) {
+        font_face = cairo_ft_font_face_create_for_pattern(match);
+        FcPatternGetString(match, FC_FILE, 0, &file);
+        DEBUG("klok: resolved font \"%s\" to %s in %.2f ms\n",
+              klok_font, file ? (const char *)file : "?",
+              (ev_time() - start) * 1000);
+    }
+    FcPatternDestroy(match);
+    return found;
+}
+
+/* Scales the font face to the given size (for an identity CTM). */
+static cairo_scaled_font_t *
+create_scaled_font(double font_size)
+{
+    cairo_font_options_t *options;
+    cairo_matrix_t font_matrix, ctm;
+    cairo_scaled_font_t *font;
+
+    cairo_matrix_init_scale(&font_matrix, font_size, font_size);
+    cairo_matrix_init_identity(&ctm);
+    options = cairo_font_options_create();
+    font = cairo_scaled_font_create(font_face, &font_matrix, &ctm, options);
+    cairo_font_options_destroy(options);
+    return font;
+}
+
+/* Returns the font face scaled to the given size, for the sizes in use. */
+static cairo_scaled_font_t *
+get_scaled_font(double font_size)
+{
+    int i;
+
+    for (i = 0; i < nb_scaled_fonts; i++) {
+        if (scaled_fonts[i].font_size == font_size)
+            return scaled_fonts[i].font;
+    }
+
+    if (nb_scaled_fonts < NB_CACHED) {
+        i = nb_scaled_fonts++;
+    } else {
+        i = rand() % NB_CACHED;
+        cairo_scaled_font_destroy(scaled_fonts[i].font);
+    }
+
+    scaled_fonts[i].font = create_scaled_font(font_size);
+    scaled_fonts[i].font_size = font_size;
+    return scaled_fonts[i].font;
+}
+
 static void
-klok_init(cairo_t *cairo)
+klok_init(void)
 {
     static bool letters_inited = false;
-
-    cairo_select_font_face(cairo,
-                           klok_font,
-                           CAIRO_FONT_SLANT_NORMAL,
-                           CAIRO_FONT_WEIGHT_BOLD);
+    int x, y;
 
     if (letters_inited)
         return;
@@ -108,407 +266,230 @@ klok_init(cairo_t *cairo)
 
     srand(time(NULL));
 
-    letters[0][0].letter[0] = 'I';
-    letters[0][1].letter[0] = 'T';
-    letters[0][2].letter[0] = random_letter();
-    letters[0][3].letter[0] = 'I';
-    letters[0][4].letter[0] = 'S';
-    letters[0][5].letter[0] = random_letter();
-    letters[0][6].letter[0] = random_letter();
-    letters[0][7].letter[0] = random_letter();
-    letters[0][8].letter[0] = random_letter();
-    letters[0][9].letter[0] = random_letter();
-    letters[0][10].letter[0] = random_letter();
-
-    letters[1][0].letter[0] = 'A';
-    letters[1][1].letter[0] = random_letter();
-    letters[1][2].letter[0] = 'Q';
-    letters[1][3].letter[0] = 'U';
-    letters[1][4].letter[0] = 'A';
-    letters[1][5].letter[0] = 'R';
-    letters[1][6].letter[0] = 'T';
-    letters[1][7].letter[0] = 'E';
-    letters[1][8].letter[0] = 'R';
-    letters[1][9].letter[0] = random_letter();
-    letters[1][10].letter[0] = random_letter();
-
-    letters[2][0].letter[0] = 'T';
-    letters[2][1].letter[0] = 'W';
-    letters[2][2].letter[0] = 'E';
-    letters[2][3].letter[0] = 'N';
-    letters[2][4].letter[0] = 'T';
-    letters[2][5].letter[0] = 'Y';
-    letters[2][6].letter[0] = 'F';
-    letters[2][7].letter[0] = 'I';
-    letters[2][8].letter[0] = 'V';
-    letters[2][9].letter[0] = 'E';
-    letters[2][10].letter[0] = random_letter();
-
-    letters[3][0].letter[0] = 'H';
-    letters[3][1].letter[0] = 'A';
-    letters[3][2].letter[0] = 'L';
-    letters[3][3].letter[0] = 'F';
-    letters[3][4].letter[0] = random_letter();
-    letters[3][5].letter[0] = 'T';
-    letters[3][6].letter[0] = 'E';
-    letters[3][7].letter[0] = 'N';
-    letters[3][8].letter[0] = random_letter();
-    letters[3][9].letter[0] = 'T';
-    letters[3][10].letter[0] = 'O';
-
-    letters[4][0].letter[0] = 'P';
-    letters[4][1].letter[0] = 'A';
-    letters[4][2].letter[0] = 'S';
-    letters[4][3].letter[0] = 'T';
-    letters[4][4].letter[0] = random_letter();
-    letters[4][5].letter[0] = random_letter();
-    letters[4][6].letter[0] = random_letter();
-    letters[4][7].letter[0] = 'N';
-    letters[4][8].letter[0] = 'I';
-    letters[4][9].letter[0] = 'N';
-    letters[4][10].letter[0] = 'E';
-
-    letters[5][0].letter[0] = 'O';
-    letters[5][1].letter[0] = 'N';
-    letters[5][2].letter[0] = 'E';
-    letters[5][3].letter[0] = 'S';
-    letters[5][4].letter[0] = 'I';
-    letters[5][5].letter[0] = 'X';
-    letters[5][6].letter[0] = 'T';
-    letters[5][7].letter[0] = 'H';
-    letters[5][8].letter[0] = 'R';
-    letters[5][9].letter[0] = 'E';
-    letters[5][10].letter[0] = 'E';
-
-    letters[6][0].letter[0] = 'F';
-    letters[6][1].letter[0] = 'O';
-    letters[6][2].letter[0] = 'U';
-    letters[6][3].letter[0] = 'R';
-    letters[6][4].letter[0] = 'F';
-    letters[6][5].letter[0] = 'I';
-    letters[6][6].letter[0] = 'V';
-    letters[6][7].letter[0] = 'E';
-    letters[6][8].letter[0] = 'T';
-    letters[6][9].letter[0] = 'W';
-    letters[6][10].letter[0] = 'O';
-
-    letters[7][0].letter[0] = 'E';
-    letters[7][1].letter[0] = 'I';
-    letters[7][2].letter[0] = 'G';
-    letters[7][3].letter[0] = 'H';
-    letters[7][4].letter[0] = 'T';
-    letters[7][5].letter[0] = 'E';
-    letters[7][6].letter[0] = 'L';
-    letters[7][7].letter[0] = 'E';
-    letters[7][8].letter[0] = 'V';
-    letters[7][9].letter[0] = 'E';
-    letters[7][10].letter[0] = 'N';
-
-    letters[8][0].letter[0] = 'S';
-    letters[8][1].letter[0] = 'E';
-    letters[8][2].letter[0] = 'V';
-    letters[8][3].letter[0] = 'E';
-    letters[8][4].letter[0] = 'N';
-    letters[8][5].letter[0] = 'T';
-    letters[8][6].letter[0] = 'W';
-    letters[8][7].letter[0] = 'E';
-    letters[8][8].letter[0] = 'L';
-    letters[8][9].letter[0] = 'V';
-    letters[8][10].letter[0] = 'E';
-
-    letters[9][0].letter[0] = 'T';
-    letters[9][1].letter[0] = 'E';
-    letters[9][2].letter[0] = 'N';
-    letters[9][3].letter[0] = random_letter();
-    letters[9][4].letter[0] = random_letter();
-    letters[9][5].letter[0] = 'O';
-    letters[9][6].letter[0] = 'C';
-    letters[9][7].letter[0] = 'L';
-    letters[9][8].letter[0] = 'O';
-    letters[9][9].letter[0] = 'C';
-    letters[9][10].letter[0] = 'K';
+    for (y = 0; y < NB_HEIGHT; y++) {
+        for (x = 0; x < NB_WIDTH; x++) {
+            char c = language->grid[y][x];
+            letters[y][x].letter[0] = (c == '.' ? random_letter() : c);
+        }
+    }
+
+    klok_expand_slots(language, slots);
 
     letters_inited = true;
 }
 
+/* Sets is_on of all letters of the given word. */
 static void
-switch_letters_on(void)
+set_word(const struct word *word, bool is_on)
 {
-    struct tm tm;
-    time_t t = time(NULL);
-    int x, y;
+    int i;
 
-    localtime_r(&t, &tm);
+    for (i = 0; i < word->len; i++)
+        letters[word->row][word->col + i].is_on = is_on;
+}
 
-    /* Clear previous run */
-    for (y = 0; y < NB_HEIGHT; y++) {
-        for (x = 0; x < NB_WIDTH; x++) {
-            letters[y][x].is_on = false;
-        }
-    }
-    /* IT IS */
-    letters[0][0].is_on = true;
-    letters[0][1].is_on = true;
-    letters[0][3].is_on = true;
-    letters[0][4].is_on = true;
-
-    /* A QUARTER */
-    if ((15 <= tm.tm_min && tm.tm_min < 20)
-        ||  (45 <= tm.tm_min && tm.tm_min < 50))
-    {
-        letters[1][0].is_on = true;
-        letters[1][2].is_on = true;
-        letters[1][3].is_on = true;
-        letters[1][4].is_on = true;
-        letters[1][5].is_on = true;
-        letters[1][6].is_on = true;
-        letters[1][7].is_on = true;
-        letters[1][8].is_on = true;
-    }
-    /* TWENTY */
-    if ((20 <= tm.tm_min && tm.tm_min < 30)
-        ||  (35 <= tm.tm_min && tm.tm_min < 45))
-    {
-        letters[2][0].is_on = true;
-        letters[2][1].is_on = true;
-        letters[2][2].is_on = true;
-        letters[2][3].is_on = true;
-        letters[2][4].is_on = true;
-        letters[2][5].is_on = true;
+/* Returns the areas (in root window coordinates) to draw a klok on: one per
+ * output, or the whole root window if we don’t know about outputs. */
+static int
+get_areas(uint32_t resolution_w,
+          uint32_t resolution_h,
+          Rect *root,
+          Rect **areas)
+{
+    if (xr_screens > 0) {
+        *areas = xr_resolutions;
+        return xr_screens;
     }
 
-    /* FIVE */
-    if ((5 <= tm.tm_min && tm.tm_min < 10)
-        ||  (25 <= tm.tm_min && tm.tm_min < 30)
-        ||  (35 <= tm.tm_min && tm.tm_min < 40)
-        ||  (55 <= tm.tm_min && tm.tm_min < 60))
-    {
-        letters[2][6].is_on = true;
-        letters[2][7].is_on = true;
-        letters[2][8].is_on = true;
-        letters[2][9].is_on = true;
-    }
+    root->x = 0;
+    root->y = 0;
+    root->width = resolution_w;
+    root->height = resolution_h;
+    *areas = root;
+    return 1;
+}
 
-    /* HALF */
-    if (30 <= tm.tm_min && tm.tm_min < 35) {
-        letters[3][0].is_on = true;
-        letters[3][1].is_on = true;
-        letters[3][2].is_on = true;
-        letters[3][3].is_on = true;
-    }
+static struct layout *
+find_layout(uint32_t resolution_w,
+            uint32_t resolution_h)
+{
+    int i;
 
-    /* TEN */
-    if ((10 <= tm.tm_min && tm.tm_min < 15)
-        ||  (50 <= tm.tm_min && tm.tm_min < 55))
-    {
-        letters[3][5].is_on = true;
-        letters[3][6].is_on = true;
-        letters[3][7].is_on = true;
+    for (i = 0; i < nb_layouts; i++) {
+        if (layouts[i].resolution_w == resolution_w &&
+            layouts[i].resolution_h == resolution_h)
+            return &layouts[i];
     }
+    return NULL;
+}
 
-    /* TO */
-    if (35 <= tm.tm_min && tm.tm_min < 60) {
-        letters[3][9].is_on = true;
-        letters[3][10].is_on = true;
-    }
+static struct atlas *
+find_atlas(double font_size)
+{
+    int i;
 
-    /* PAST */
-    if (5 <= tm.tm_min && tm.tm_min < 35) {
-        letters[4][0].is_on = true;
-        letters[4][1].is_on = true;
-        letters[4][2].is_on = true;
-        letters[4][3].is_on = true;
+    for (i = 0; i < nb_atlases; i++) {
+        if (atlases[i].font_size == font_size)
+            return &atlases[i];
     }
+    return NULL;
+}
 
-    /* NINE */
-    if (((tm.tm_hour == 8 || tm.tm_hour == 20) &&
-         (tm.tm_min >= 35 ))
-        || ((tm.tm_hour == 9 || tm.tm_hour == 21) &&
-            (0 <= tm.tm_min && tm.tm_min < 35 )))
-    {
-        letters[4][7].is_on = true;
-        letters[4][8].is_on = true;
-        letters[4][9].is_on = true;
-        letters[4][10].is_on = true;
-    }
+/* Turns on the letters for the current time. When changed is not NULL, it is
+ * filled with the areas of the words which were turned on or off on each
+ * output and their number is returned (-1 if the letters were not laid out
+ * yet). */
+static int
+switch_letters_on(xcb_rectangle_t *changed)
+{
+    static uint32_t current_mask;
+    struct tm tm;
+    time_t t = time(NULL);
+    uint32_t mask, diff;
+    Rect root, *areas;
+    int w, a, n, nb_areas;
 
-    /* ONE */
-    if (((tm.tm_hour == 0 || tm.tm_hour == 12) &&
-         (tm.tm_min >= 35 ))
-        || ((tm.tm_hour == 1 || tm.tm_hour == 13) &&
-            (0 <= tm.tm_min && tm.tm_min < 35 )))
-    {
-        letters[5][0].is_on = true;
-        letters[5][1].is_on = true;
-        letters[5][2].is_on = true;
-    }
+    localtime_r(&t, &tm);
 
-    /* SIX */
-    if (((tm.tm_hour == 5 || tm.tm_hour == 17) &&
-         (tm.tm_min >= 35 ))
-        || ((tm.tm_hour == 6 || tm.tm_hour == 18) &&
-            (0 <= tm.tm_min && tm.tm_min < 35 )))
-    {
-        letters[5][3].is_on = true;
-        letters[5][4].is_on = true;
-        letters[5][5].is_on = true;
-    }
+    mask = slots[tm.tm_hour * 12 + tm.tm_min / 5];
+    diff = mask ^ current_mask;
+    current_mask = mask;
+    if (diff == 0)
+        return 0;
 
-    /* THREE */
-    if (((tm.tm_hour == 2 || tm.tm_hour == 14) &&
-         (tm.tm_min >= 35 ))
-        || ((tm.tm_hour == 3 || tm.tm_hour == 15) &&
-            (0 <= tm.tm_min && tm.tm_min < 35 )))
-    {
-        letters[5][6].is_on = true;
-        letters[5][7].is_on = true;
-        letters[5][8].is_on = true;
-        letters[5][9].is_on = true;
-        letters[5][10].is_on = true;
+    /* Turn off first, words might share letters. */
+    for (w = 0; w < language->nb_words; w++) {
+        if (diff & ~mask & WORD(w))
+            set_word(&language->words[w], false);
     }
-
-    /* FOUR */
-    if (((tm.tm_hour == 3 || tm.tm_hour == 15) &&
-         (tm.tm_min >= 35 ))
-        || ((tm.tm_hour == 4 || tm.tm_hour == 16) &&
-            (0 <= tm.tm_min && tm.tm_min < 35 )))
-    {
-        letters[6][0].is_on = true;
-        letters[6][1].is_on = true;
-        letters[6][2].is_on = true;
-        letters[6][3].is_on = true;
+    for (w = 0; w < language->nb_words; w++) {
+        if (mask & WORD(w))
+            set_word(&language->words[w], true);
     }
 
-    /* FIVE */
-    if (((tm.tm_hour == 4 || tm.tm_hour == 16) &&
-         (tm.tm_min >= 35 ))
-        || ((tm.tm_hour == 5 || tm.tm_hour == 17) &&
-            (0 <= tm.tm_min && tm.tm_min < 35 )))
-    {
-        letters[6][4].is_on = true;
-        letters[6][5].is_on = true;
-        letters[6][6].is_on = true;
-        letters[6][7].is_on = true;
-    }
+    if (changed == NULL)
+        return 0;
 
-    /* TWO */
-    if (((tm.tm_hour == 1 || tm.tm_hour == 13) &&
-         (tm.tm_min >= 35 ))
-        || ((tm.tm_hour == 2 || tm.tm_hour == 14) &&
-            (0 <= tm.tm_min && tm.tm_min < 35 )))
-    {
-        letters[6][8].is_on = true;
-        letters[6][9].is_on = true;
-        letters[6][10].is_on = true;
-    }
+    n = 0;
+    nb_areas = get_areas(last_resolution[0], last_resolution[1], &root, &areas);
+    for (a = 0; a < nb_areas; a++) {
+        struct layout *layout = find_layout(areas[a].width, areas[a].height);
+        struct atlas *atlas = (layout ? find_atlas(layout->font_size) : NULL);
 
-    /* EIGHT */
-    if (((tm.tm_hour == 7 || tm.tm_hour == 19) &&
-         (tm.tm_min >= 35 ))
-        || ((tm.tm_hour == 8 || tm.tm_hour == 20) &&
-            (0 <= tm.tm_min && tm.tm_min < 35 )))
-    {
-        letters[7][0].is_on = true;
-        letters[7][1].is_on = true;
-        letters[7][2].is_on = true;
-        letters[7][3].is_on = true;
-        letters[7][4].is_on = true;
-    }
+        if (atlas == NULL)
+            return -1;
 
-    /* ELEVEN */
-    if (((tm.tm_hour == 10 || tm.tm_hour == 22) &&
-         (tm.tm_min >= 35 ))
-        || ((tm.tm_hour == 11 || tm.tm_hour == 23) &&
-            (0 <= tm.tm_min && tm.tm_min < 35 )))
-    {
-        letters[7][5].is_on = true;
-        letters[7][6].is_on = true;
-        letters[7][7].is_on = true;
-        letters[7][8].is_on = true;
-        letters[7][9].is_on = true;
-        letters[7][10].is_on = true;
-    }
+        for (w = 0; w < language->nb_words; w++) {
+            const struct word *word = &language->words[w];
 
-    /* SEVEN */
-    if (((tm.tm_hour == 6 || tm.tm_hour == 18) &&
-         (tm.tm_min >= 35 ))
-        || ((tm.tm_hour == 7 || tm.tm_hour == 19) &&
-            (0 <= tm.tm_min && tm.tm_min < 35 )))
-    {
-        letters[8][0].is_on = true;
-        letters[8][1].is_on = true;
-        letters[8][2].is_on = true;
-        letters[8][3].is_on = true;
-        letters[8][4].is_on = true;
-    }
+            if (!(diff & WORD(w)))
+                continue;
 
-    /* TWELVE */
-    if (((tm.tm_hour == 11 || tm.tm_hour == 23) &&
-         (tm.tm_min >= 35 ))
-        || ((tm.tm_hour == 0 || tm.tm_hour == 12) &&
-            (0 <= tm.tm_min && tm.tm_min < 35 )))
-    {
-        letters[8][5].is_on = true;
-        letters[8][6].is_on = true;
-        letters[8][7].is_on = true;
-        letters[8][8].is_on = true;
-        letters[8][9].is_on = true;
-        letters[8][10].is_on = true;
+            changed[n].x = areas[a].x + layout->off_x[word->col]
+                - atlas->origin_x;
+            changed[n].y = areas[a].y + layout->off_y[word->row]
+                - atlas->origin_y;
+            changed[n].width = layout->off_x[word->col + word->len - 1]
+                - layout->off_x[word->col] + atlas->cell_w;
+            changed[n].height = atlas->cell_h;
+            n++;
+        }
     }
+    return n;
+}
 
-    /* TEN */
-    if (((tm.tm_hour == 9 || tm.tm_hour == 21) &&
-         (tm.tm_min >= 35 ))
-        || ((tm.tm_hour == 10 || tm.tm_hour == 22) &&
-            (0 <= tm.tm_min && tm.tm_min < 35 )))
-    {
-        letters[9][0].is_on = true;
-        letters[9][1].is_on = true;
-        letters[9][2].is_on = true;
-    }
+static bool
+text_size_fits(double size,
+               uint32_t max_letter_width,
+               uint32_t max_letter_height)
+{
+    cairo_scaled_font_t *font;
+    cairo_text_extents_t extents;
 
-    /* OCLOCK */
-    if (0 <= tm.tm_min && tm.tm_min < 5) {
-        letters[9][5].is_on = true;
-        letters[9][6].is_on = true;
-        letters[9][7].is_on = true;
-        letters[9][8].is_on = true;
-        letters[9][9].is_on = true;
-        letters[9][10].is_on = true;
-    }
+    /* Most probed sizes are never drawn, so keep them out of scaled_fonts. */
+    font = create_scaled_font(size);
+    cairo_scaled_font_text_extents(font, "W", &extents);
+    cairo_scaled_font_destroy(font);
+    return (extents.width <= max_letter_width &&
+            extents.height <= max_letter_height);
 }
 
-static void
-find_best_text_size(cairo_t *cr,
-                    uint32_t max_letter_width,
+/* Bisects the biggest font size (between 10 and 200) at which a "W" fits in
+ * the given box. */
+static double
+find_best_text_size(uint32_t max_letter_width,
                     uint32_t max_letter_height,
                     cairo_text_extents_t *exts)
 {
-    double size = 10.0;
-    cairo_scaled_font_t *sf;
-
-    while (size < 200) {
-        cairo_text_extents_t extents;
-        cairo_set_font_size(cr, size);
-        sf = cairo_get_scaled_font(cr);
-        cairo_scaled_font_text_extents(sf, "W", &extents);
-        if (extents.width > max_letter_width ||
-            extents.height > max_letter_height) {
-            size -= 1.0;
-            break;
-        }
+    int lo = 9, hi = 201;
+
+    while (hi - lo > 1) {
+        int mid = (lo + hi) / 2;
+        if (text_size_fits(mid, max_letter_width, max_letter_height))
+            lo = mid;
+        else
+            hi = mid;
+    }
+    cairo_scaled_font_text_extents(get_scaled_font(lo), "W", exts);
+    return lo;
+}
+
+/* Returns the font size and letter positions for the given output size,
+ * computing them unless they are already known. */
+static struct layout *
+get_layout(uint32_t resolution_w,
+           uint32_t resolution_h)
+{
+    struct layout *layout;
+    uint32_t sq;
+    uint32_t max_letter_width, max_letter_height;
+    uint32_t orig_x_offset, orig_y_offset;
+    uint32_t dx, dy;
+    int x, y;
+
+    if ((layout = find_layout(resolution_w, resolution_h)) != NULL)
+        return layout;
+
+    if (nb_layouts < NB_CACHED)
+        layout = &layouts[nb_layouts++];
+    else
+        layout = &layouts[rand() % NB_CACHED];
+
+    sq = resolution_h;
+    if (resolution_w < sq)
+        sq = resolution_w;
+
+    sq *= 0.9;
+
+    orig_y_offset = (resolution_h - sq) / 2;
+    orig_x_offset = (resolution_w - sq) / 2;
+    max_letter_width = 8 * sq / (10 * 11);
+    max_letter_height= 8 * sq / (10 * 10);
 
-        size += 1.0;
+    layout->font_size = find_best_text_size(max_letter_width,
+                                            max_letter_height,
+                                            &layout->extents);
+    dx = (sq - NB_WIDTH * layout->extents.width) / (NB_WIDTH - 1);
+    dy = (sq - NB_HEIGHT * layout->extents.height) / (NB_HEIGHT - 1);
+    for (x = 0; x < NB_WIDTH; x++) {
+        layout->off_x[x] = dx * x + x * layout->extents.width + orig_x_offset;
+    }
+    for (y = 0; y < NB_HEIGHT; y++) {
+        layout->off_y[y] = dy * y + y * layout->extents.height
+            + orig_y_offset + layout->extents.height;
     }
-    cairo_set_font_size(cr, size);
-    sf = cairo_get_scaled_font(cr);
-    cairo_scaled_font_text_extents(sf, "W", exts);
-    font_size = size;
+
+    layout->resolution_w = resolution_w;
+    layout->resolution_h = resolution_h;
+    DEBUG("klok: font size %.f for %ux%u\n",
+          layout->font_size, resolution_w, resolution_h);
+    return layout;
 }
 
 static void
 draw_letter(cairo_t *cr,
             struct letter *letter,
+            double font_size,
             uint32_t off_x,
             uint32_t off_y)
 {
@@ -525,73 +506,197 @@ draw_letter(cairo_t *cr,
     cairo_stroke(cr);
 }
 
+/* Returns the atlas with every letter, on and off, rendered at the given font
+ * size, rendering it unless it already exists. */
+static struct atlas *
+get_atlas(double font_size)
+{
+    cairo_scaled_font_t *font = get_scaled_font(font_size);
+    struct atlas *atlas;
+    cairo_font_extents_t fe;
+    cairo_t *actx;
+    int pad, c, on;
+
+    if ((atlas = find_atlas(font_size)) != NULL)
+        return atlas;
+
+    if (nb_atlases < NB_CACHED) {
+        atlas = &atlases[nb_atlases++];
+    } else {
+        atlas = &atlases[rand() % NB_CACHED];
+        cairo_surface_destroy(atlas->surface);
+    }
+
+    cairo_scaled_font_extents(font, &fe);
+    /* Leave room for the shadow stroke around the glyphs. */
+    pad = ceil(font_size / 25.0) + 1;
+    atlas->cell_w = ceil(fe.max_x_advance) + 2 * pad;
+    atlas->cell_h = ceil(fe.ascent + fe.descent) + 2 * pad;
+    atlas->origin_x = pad;
+    atlas->origin_y = pad + ceil(fe.ascent);
+    atlas->font_size = font_size;
+    atlas->surface = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+                                                NB_LETTERS * atlas->cell_w,
+                                                2 * atlas->cell_h);
+
+    actx = cairo_create(atlas->surface);
+    cairo_set_scaled_font(actx, font);
+    for (on = 0; on < 2; on++) {
+        for (c = 0; c < NB_LETTERS; c++) {
+            struct letter l = { { 'A' + c, '\0' }, on };
+
+            draw_letter(actx, &l, font_size,
+                        c * atlas->cell_w + atlas->origin_x,
+                        on * atlas->cell_h + atlas->origin_y);
+        }
+    }
+    cairo_destroy(actx);
+    DEBUG("klok: rendered letter atlas of %dx%d\n",
+          NB_LETTERS * atlas->cell_w, 2 * atlas->cell_h);
+    return atlas;
+}
+
+/* Copies the pre-rendered letter from the atlas, the baseline starting at
+ * (off_x, off_y). */
 static void
-draw_letters(cairo_t *cr,
-             uint32_t resolution_w,
-             uint32_t resolution_h)
+blit_letter(cairo_t *cr,
+            struct atlas *atlas,
+            struct letter *letter,
+            uint32_t off_x,
+            uint32_t off_y)
 {
-    uint32_t sq = resolution_w;
-    uint32_t max_letter_width, max_letter_height;
-    cairo_text_extents_t extents;
-    uint32_t orig_x_offset, orig_y_offset;
-    uint32_t dx, dy;
-    int x, y;
+    int c = letter->letter[0] - 'A';
+    int on = letter->is_on ? 1 : 0;
+    double x, y;
 
-    sq = resolution_h;
-    if (resolution_w < sq)
-        sq = resolution_w;
+    if (c < 0 || c >= NB_LETTERS) {
+        draw_letter(cr, letter, atlas->font_size, off_x, off_y);
+        return;
+    }
 
-    sq *= 0.9;
+    x = (double)off_x - atlas->origin_x;
+    y = (double)off_y - atlas->origin_y;
+    cairo_set_source_surface(cr, atlas->surface,
+                             x - c * atlas->cell_w,
+                             y - on * atlas->cell_h);
+    cairo_rectangle(cr, x, y, atlas->cell_w, atlas->cell_h);
+    cairo_fill(cr);
+}
 
-    orig_y_offset = (resolution_h - sq) / 2;
-    orig_x_offset = (resolution_w - sq) / 2;
-    max_letter_width = 8 * sq / (10 * 11);
-    max_letter_height= 8 * sq / (10 * 10);
+static void
+draw_letters(cairo_t *cr,
+             Rect *area)
+{
+    struct layout *layout;
+    struct atlas *atlas;
+    int x, y;
+
+    layout = get_layout(area->width, area->height);
+    cairo_set_scaled_font(cr, get_scaled_font(layout->font_size));
+    atlas = get_atlas(layout->font_size);
 
-    find_best_text_size(cr, max_letter_width, max_letter_height,
-                        &extents);
-    dx = (sq - NB_WIDTH * extents.width) / (NB_WIDTH - 1);
-    dy = (sq - NB_HEIGHT * extents.height) / (NB_HEIGHT - 1);
     for (y = 0; y < NB_HEIGHT; y++) {
         for (x = 0; x < NB_WIDTH; x++) {
-            uint32_t off_x, off_y;
-
-            off_x = dx * x + x * extents.width + orig_x_offset;
-            off_y = dy * y + y * extents.height + orig_y_offset + extents.height;
-            draw_letter(cr, &letters[y][x], off_x, off_y);
+            blit_letter(cr, atlas, &letters[y][x],
+                        area->x + layout->off_x[x],
+                        area->y + layout->off_y[y]);
         }
     }
 }
 
+/* Draws one klok per output, sized to the output. */
 void
 draw_klok(cairo_t *cairo,
           uint32_t resolution_w,
           uint32_t resolution_h)
 {
-    klok_init(cairo);
-    switch_letters_on();
-    draw_letters(cairo, resolution_w, resolution_h);
+    Rect root, *areas;
+    int a, nb_areas;
+
+    klok_init();
+    switch_letters_on(NULL);
+
+    nb_areas = get_areas(resolution_w, resolution_h, &root, &areas);
+    for (a = 0; a < nb_areas; a++)
+        draw_letters(cairo, &areas[a]);
 }
 
 static void
-time_change(struct ev_loop *loop, ev_timer *w, int revents)
+update_klok(void)
 {
-    redraw_screen();
+    xcb_rectangle_t changed[32 * (xr_screens > 0 ? xr_screens : 1)];
+    int n = switch_letters_on(changed);
+
+    DEBUG("klok: %d words changed\n", n);
+    if (n < 0)
+        redraw_screen();
+    else if (n > 0)
+        redraw_areas(changed, n);
 }
 
-void
-klok_add_timer(void)
+/* Fires on every 5-minute boundary of the wall clock. Time zones are all
+ * offset from UTC by a multiple of 5 minutes, so aligning on UTC is enough. */
+static ev_periodic periodic;
+
+static void
+time_change(struct ev_loop *loop, ev_periodic *w, int revents)
 {
-    ev_timer *timer;
-    struct tm tm;
-    time_t t = time(NULL);
+    update_klok();
+}
 
-    localtime_r(&t, &tm);
-    timer = calloc(sizeof(struct ev_timer), 1);
+#if defined(__linux__)
+/* A realtime timer set far in the future, only there so that the kernel
+ * cancels it whenever the wall clock is set (by NTP, date or on resume
+ * from suspend), which makes the fd readable. */
+static int clock_fd = -1;
+static ev_io clock_watcher;
 
-    ev_timer_init(timer, time_change,
-                  5 * 60 - ((tm.tm_min % 5) * 60 + tm.tm_sec),
-                  5 * 60);
-    ev_timer_start(main_loop, timer);
+static bool
+arm_clock_fd(void)
+{
+    struct itimerspec its = {};
+
+    its.it_value.tv_sec = time(NULL) + 10 * 365 * 24 * 60 * 60;
+    return timerfd_settime(clock_fd,
+                           TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET,
+                           &its, NULL) == 0;
+}
 
+static void
+clock_set_cb(struct ev_loop *loop, ev_io *w, int revents)
+{
+    uint64_t expirations;
+
+    /* read() fails with ECANCELED after the clock was set, the timer has to
+     * be armed again to keep getting notified. */
+    if (read(clock_fd, &expirations, sizeof(expirations)) < 0 &&
+        errno != ECANCELED && errno != EAGAIN)
+        return;
+    arm_clock_fd();
+
+    DEBUG("klok: wall clock changed\n");
+    ev_now_update(loop);
+    ev_periodic_again(loop, &periodic);
+    update_klok();
+}
+#endif
+
+void
+klok_add_timer(void)
+{
+    ev_periodic_init(&periodic, time_change, 0., 5 * 60, 0);
+    ev_periodic_start(main_loop, &periodic);
+
+#if defined(__linux__)
+    clock_fd = timerfd_create(CLOCK_REALTIME, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (clock_fd < 0 || !arm_clock_fd()) {
+        DEBUG("klok: cannot watch for clock changes: %s\n", strerror(errno));
+        if (clock_fd >= 0)
+            close(clock_fd);
+        clock_fd = -1;
+        return;
+    }
+    ev_io_init(&clock_watcher, clock_set_cb, clock_fd, EV_READ);
+    ev_io_start(main_loop, &clock_watcher);
+#endif
 }
@@ -7,5 +7,7 @@ draw_klok(cairo_t *cairo,
           uint32_t resolution_h);
 void
 klok_add_timer(void);
+bool
+klok_load_font(void);
 
 #endif
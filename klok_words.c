@@ -0,0 +1,106 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * © 2016 Boris Faure
+ *
+ * klok_words.c: the words of the klok and which of them are on at what time.
+ *               Kept apart from the drawing code so that it can be checked
+ *               without X11 (see tests/klok_slots.c).
+ *
+ */
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "klok_words.h"
+
+enum {
+    EN_IT, EN_IS, EN_A, EN_QUARTER, EN_TWENTY, EN_FIVE_MIN, EN_HALF,
+    EN_TEN_MIN, EN_TO, EN_PAST, EN_NINE, EN_ONE, EN_SIX, EN_THREE, EN_FOUR,
+    EN_FIVE, EN_TWO, EN_EIGHT, EN_ELEVEN, EN_SEVEN, EN_TWELVE, EN_TEN,
+    EN_OCLOCK, EN_NB_WORDS
+};
+
+static const struct word english_words[EN_NB_WORDS] = {
+    [EN_IT] = { 0, 0, 2 },
+    [EN_IS] = { 0, 3, 2 },
+    [EN_A] = { 1, 0, 1 },
+    [EN_QUARTER] = { 1, 2, 7 },
+    [EN_TWENTY] = { 2, 0, 6 },
+    [EN_FIVE_MIN] = { 2, 6, 4 },
+    [EN_HALF] = { 3, 0, 4 },
+    [EN_TEN_MIN] = { 3, 5, 3 },
+    [EN_TO] = { 3, 9, 2 },
+    [EN_PAST] = { 4, 0, 4 },
+    [EN_NINE] = { 4, 7, 4 },
+    [EN_ONE] = { 5, 0, 3 },
+    [EN_SIX] = { 5, 3, 3 },
+    [EN_THREE] = { 5, 6, 5 },
+    [EN_FOUR] = { 6, 0, 4 },
+    [EN_FIVE] = { 6, 4, 4 },
+    [EN_TWO] = { 6, 8, 3 },
+    [EN_EIGHT] = { 7, 0, 5 },
+    [EN_ELEVEN] = { 7, 5, 6 },
+    [EN_SEVEN] = { 8, 0, 5 },
+    [EN_TWELVE] = { 8, 5, 6 },
+    [EN_TEN] = { 9, 0, 3 },
+    [EN_OCLOCK] = { 9, 5, 6 },
+};
+
+const struct language klok_english = {
+    .grid = {
+        "IT.IS......",
+        "A.QUARTER..",
+        "TWENTYFIVE.",
+        "HALF.TEN.TO",
+        "PAST...NINE",
+        "ONESIXTHREE",
+        "FOURFIVETWO",
+        "EIGHTELEVEN",
+        "SEVENTWELVE",
+        "TEN..OCLOCK",
+    },
+    .words = english_words,
+    .nb_words = EN_NB_WORDS,
+    .always = WORD(EN_IT) | WORD(EN_IS),
+    .minutes = {
+        WORD(EN_OCLOCK),
+        WORD(EN_FIVE_MIN) | WORD(EN_PAST),
+        WORD(EN_TEN_MIN) | WORD(EN_PAST),
+        WORD(EN_A) | WORD(EN_QUARTER) | WORD(EN_PAST),
+        WORD(EN_TWENTY) | WORD(EN_PAST),
+        WORD(EN_TWENTY) | WORD(EN_FIVE_MIN) | WORD(EN_PAST),
+        WORD(EN_HALF) | WORD(EN_PAST),
+        WORD(EN_TWENTY) | WORD(EN_FIVE_MIN) | WORD(EN_TO),
+        WORD(EN_TWENTY) | WORD(EN_TO),
+        WORD(EN_A) | WORD(EN_QUARTER) | WORD(EN_TO),
+        WORD(EN_TEN_MIN) | WORD(EN_TO),
+        WORD(EN_FIVE_MIN) | WORD(EN_TO),
+    },
+    .hours = {
+        WORD(EN_TWELVE), WORD(EN_ONE), WORD(EN_TWO), WORD(EN_THREE),
+        WORD(EN_FOUR), WORD(EN_FIVE), WORD(EN_SIX), WORD(EN_SEVEN),
+        WORD(EN_EIGHT), WORD(EN_NINE), WORD(EN_TEN), WORD(EN_ELEVEN),
+    },
+    .next_hour_from = 35,
+};
+
+/*
+ * Expands the per-minute and per-hour words of the given language into one
+ * mask for every five minute slot of the day.
+ *
+ */
+void
+klok_expand_slots(const struct language *language,
+                  uint32_t slots[NB_SLOTS])
+{
+    int h, m;
+
+    for (h = 0; h < 24; h++) {
+        for (m = 0; m < 12; m++) {
+            int hour = (h + (m * 5 >= language->next_hour_from)) % 12;
+            slots[h * 12 + m] = language->always |
+                language->minutes[m] |
+                language->hours[hour];
+        }
+    }
+}
@@ -0,0 +1,43 @@
+#ifndef _KLOK_WORDS_H
+#define _KLOK_WORDS_H
+
+#include <stdint.h>
+
+#define NB_WIDTH 11
+#define NB_HEIGHT 10
+
+/* Five minute slots of a day. */
+#define NB_SLOTS (24 * 12)
+
+struct word {
+    int row;
+    int col;
+    int len;
+};
+
+#define WORD(w) (1u << (w))
+
+/* A word clock in one language. Words are referred to by their index in
+ * words, as bits of a mask. */
+struct language {
+    /* The letters, '.' is replaced by a random letter. */
+    const char *grid[NB_HEIGHT];
+    const struct word *words;
+    int nb_words;
+    /* The words which are always on ("IT IS"). */
+    uint32_t always;
+    /* The words for minutes 0-4, 5-9, …, 55-59. */
+    uint32_t minutes[12];
+    /* The words for the hours 12 (or 0), 1, …, 11. */
+    uint32_t hours[12];
+    /* From this minute on, the next hour is shown ("TEN TO FIVE"). */
+    int next_hour_from;
+};
+
+extern const struct language klok_english;
+
+void
+klok_expand_slots(const struct language *language,
+                  uint32_t slots[NB_SLOTS]);
+
+#endif
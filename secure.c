@@ -0,0 +1,116 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * © 2016 Boris Faure
+ *
+ * secure.c: a small arena for everything which holds (parts of) the password.
+ *           It is locked in memory and excluded from core dumps. Every buffer
+ *           sits right before an inaccessible guard page, and the first one
+ *           right after another, so that overflows out of one buffer crash
+ *           instead of reaching the next one.
+ *
+ */
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <err.h>
+#include <sys/mman.h>
+
+#include "secure.h"
+
+static uint8_t *arena;
+static size_t arena_size;
+static size_t arena_used;
+static size_t page;
+
+/* The readable pages of every buffer, without the guard pages. */
+static struct {
+    uint8_t *start;
+    size_t len;
+} *buffers;
+static unsigned int num_buffers;
+static unsigned int max_buffers;
+
+/*
+ * Locks the pages of one buffer in memory.
+ *
+ */
+static void lock_buffer(uint8_t *start, size_t len) {
+    /* Using mlock() as non-super-user seems only possible in Linux. Users of
+     * other operating systems should use encrypted swap/no swap (or remove
+     * the ifdef and run i3lock as super-user). */
+#if defined(__linux__)
+    /* Lock the area where we store the password in memory, we don’t want it
+     * to be swapped to disk. Since Linux 2.6.9, this does not require any
+     * privileges, just enough bytes in the RLIMIT_MEMLOCK limit. */
+    if (mlock(start, len) != 0)
+        err(EXIT_FAILURE, "Could not lock page in memory, check RLIMIT_MEMLOCK");
+#endif
+}
+
+/*
+ * Maps the arena, big enough for count buffers of size bytes in total, each
+ * followed by a guard page. Exits if that fails, since we would otherwise
+ * store the password in memory which may end up in swap.
+ *
+ */
+void secure_init(unsigned int count, size_t size) {
+    uint8_t *mem;
+
+    page = sysconf(_SC_PAGESIZE);
+    max_buffers = count;
+    if ((buffers = calloc(count, sizeof(*buffers))) == NULL)
+        err(EXIT_FAILURE, "calloc");
+
+    /* Rounding every buffer up to whole pages adds less than a page each. */
+    arena_size = ((size + page - 1) / page + 2 * count) * page;
+    mem = mmap(NULL, arena_size + page, PROT_NONE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+        err(EXIT_FAILURE, "Could not map the password arena");
+
+    arena = mem + page;
+#ifdef MADV_DONTDUMP
+    (void)madvise(arena, arena_size, MADV_DONTDUMP);
+#endif
+}
+
+/*
+ * Returns size zeroed bytes from the arena, placed so that they end (up to
+ * the 16 bytes alignment) where the following guard page starts. Buffers live
+ * as long as the process, so they are never freed.
+ *
+ */
+void *secure_alloc(size_t size) {
+    size_t aligned = (size + 15) & ~(size_t)15;
+    size_t pages = (aligned + page - 1) / page * page;
+    uint8_t *buf;
+
+    if (arena == NULL || num_buffers == max_buffers ||
+        arena_used + pages + page > arena_size)
+        errx(EXIT_FAILURE, "The password arena is too small");
+
+    buf = arena + arena_used;
+    if (mprotect(buf, pages, PROT_READ | PROT_WRITE) != 0)
+        err(EXIT_FAILURE, "Could not map the password arena");
+
+    lock_buffer(buf, pages);
+    buffers[num_buffers].start = buf;
+    buffers[num_buffers].len = pages;
+    num_buffers++;
+
+    /* The page after the buffer stays PROT_NONE. */
+    arena_used += pages + page;
+    return buf + pages - aligned;
+}
+
+/*
+ * Locks the buffers again in a child process: memory locks are not inherited
+ * by fork().
+ *
+ */
+void secure_after_fork(void) {
+    for (unsigned int i = 0; i < num_buffers; i++)
+        lock_buffer(buffers[i].start, buffers[i].len);
+}
@@ -0,0 +1,8 @@
+#ifndef _SECURE_H
+#define _SECURE_H
+
+void secure_init(unsigned int count, size_t size);
+void *secure_alloc(size_t size);
+void secure_after_fork(void);
+
+#endif
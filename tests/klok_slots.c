@@ -0,0 +1,129 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * © 2016 Boris Faure
+ *
+ * klok_slots.c: checks that the slot table expanded by klok_expand_slots()
+ *               turns on the same letters as the hand-written conditions the
+ *               klok used before, for every minute of the day.
+ *
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "klok_words.h"
+
+static void
+turn_on(bool on[NB_HEIGHT][NB_WIDTH], int row, int col, int len)
+{
+    int i;
+
+    for (i = 0; i < len; i++)
+        on[row][col + i] = true;
+}
+
+/* The conditions of the former switch_letters_on(), one per word. */
+static void
+old_letters(int hour, int min, bool on[NB_HEIGHT][NB_WIDTH])
+{
+    memset(on, 0, sizeof(bool) * NB_HEIGHT * NB_WIDTH);
+
+    /* IT IS */
+    turn_on(on, 0, 0, 2);
+    turn_on(on, 0, 3, 2);
+
+    /* A QUARTER */
+    if ((15 <= min && min < 20) || (45 <= min && min < 50)) {
+        turn_on(on, 1, 0, 1);
+        turn_on(on, 1, 2, 7);
+    }
+    /* TWENTY */
+    if ((20 <= min && min < 30) || (35 <= min && min < 45))
+        turn_on(on, 2, 0, 6);
+    /* FIVE */
+    if ((5 <= min && min < 10) || (25 <= min && min < 30) ||
+        (35 <= min && min < 40) || (55 <= min && min < 60))
+        turn_on(on, 2, 6, 4);
+    /* HALF */
+    if (30 <= min && min < 35)
+        turn_on(on, 3, 0, 4);
+    /* TEN */
+    if ((10 <= min && min < 15) || (50 <= min && min < 55))
+        turn_on(on, 3, 5, 3);
+    /* TO */
+    if (35 <= min && min < 60)
+        turn_on(on, 3, 9, 2);
+    /* PAST */
+    if (5 <= min && min < 35)
+        turn_on(on, 4, 0, 4);
+
+#define HOUR(h1, h2, row, col, len)                                   \
+    if (((hour == (h1) || hour == (h1) + 12) && min >= 35) ||         \
+        ((hour == (h2) || hour == (h2) + 12) && min < 35))            \
+        turn_on(on, row, col, len);
+
+    HOUR(8, 9, 4, 7, 4);   /* NINE */
+    HOUR(0, 1, 5, 0, 3);   /* ONE */
+    HOUR(5, 6, 5, 3, 3);   /* SIX */
+    HOUR(2, 3, 5, 6, 5);   /* THREE */
+    HOUR(3, 4, 6, 0, 4);   /* FOUR */
+    HOUR(4, 5, 6, 4, 4);   /* FIVE */
+    HOUR(1, 2, 6, 8, 3);   /* TWO */
+    HOUR(7, 8, 7, 0, 5);   /* EIGHT */
+    HOUR(10, 11, 7, 5, 6); /* ELEVEN */
+    HOUR(6, 7, 8, 0, 5);   /* SEVEN */
+    HOUR(11, 0, 8, 5, 6);  /* TWELVE */
+    HOUR(9, 10, 9, 0, 3);  /* TEN */
+
+#undef HOUR
+
+    /* OCLOCK */
+    if (min < 5)
+        turn_on(on, 9, 5, 6);
+}
+
+static void
+new_letters(const uint32_t *slots, int hour, int min,
+            bool on[NB_HEIGHT][NB_WIDTH])
+{
+    uint32_t mask = slots[hour * 12 + min / 5];
+    int w;
+
+    memset(on, 0, sizeof(bool) * NB_HEIGHT * NB_WIDTH);
+    for (w = 0; w < klok_english.nb_words; w++) {
+        const struct word *word = &klok_english.words[w];
+
+        if (mask & WORD(w))
+            turn_on(on, word->row, word->col, word->len);
+    }
+}
+
+int
+main(void)
+{
+    uint32_t slots[NB_SLOTS];
+    bool expected[NB_HEIGHT][NB_WIDTH], got[NB_HEIGHT][NB_WIDTH];
+    int hour, min, failures = 0;
+
+    klok_expand_slots(&klok_english, slots);
+
+    for (hour = 0; hour < 24; hour++) {
+        for (min = 0; min < 60; min++) {
+            old_letters(hour, min, expected);
+            new_letters(slots, hour, min, got);
+            if (memcmp(expected, got, sizeof(expected)) != 0) {
+                fprintf(stderr, "klok_slots: %02d:%02d differs\n", hour, min);
+                failures++;
+            }
+        }
+    }
+
+    if (failures > 0) {
+        fprintf(stderr, "klok_slots: %d of 1440 minutes differ\n", failures);
+        return 1;
+    }
+    printf("klok_slots: all %d slots (1440 minutes) match\n", NB_SLOTS);
+    return 0;
+}
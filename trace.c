@@ -0,0 +1,90 @@
+/*
+ * vim:ts=4:sw=4:expandtab
+ *
+ * © 2016 Boris Faure
+ *
+ * trace.c: --trace-startup, reports the wall time and the number of X11
+ *          round-trips of every phase of the startup, up to the moment the
+ *          screen is locked. Round-trips are counted where we (or
+ *          xkbcommon-x11 on our behalf) wait for replies, see
+ *          trace_round_trips.
+ *
+ */
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <ev.h>
+
+#include "trace.h"
+
+extern bool trace_startup;
+
+#define MAX_PHASES 16
+
+static struct {
+    const char *name;
+    ev_tstamp duration;
+    unsigned int round_trips;
+} phases[MAX_PHASES];
+static int num_phases;
+
+static ev_tstamp started;
+static ev_tstamp phase_started;
+static unsigned int round_trips;
+static unsigned int phase_round_trips;
+
+/*
+ * Called wherever we block on replies of the X server. Requests whose replies
+ * are waited for together (after sending all of them) count as one round-trip.
+ * Calls into xkbcommon-x11 are counted with the number of round-trips they
+ * make at least.
+ *
+ */
+void trace_round_trips(unsigned int n) {
+    if (trace_startup)
+        round_trips += n;
+}
+
+void trace_start(void) {
+    started = phase_started = ev_time();
+}
+
+/*
+ * Ends the current phase of the startup, which gets the given name.
+ *
+ */
+void trace_phase(const char *name) {
+    ev_tstamp now = ev_time();
+
+    if (!trace_startup || num_phases == MAX_PHASES)
+        return;
+
+    phases[num_phases].name = name;
+    phases[num_phases].duration = now - phase_started;
+    phases[num_phases].round_trips = round_trips - phase_round_trips;
+    num_phases++;
+
+    phase_started = now;
+    phase_round_trips = round_trips;
+}
+
+/*
+ * Prints the phases recorded since the last report, followed by the time and
+ * round-trips since the start up to the given milestone. With last set,
+ * recording stops.
+ *
+ */
+void trace_report(const char *milestone, bool last) {
+    if (!trace_startup)
+        return;
+
+    for (int i = 0; i < num_phases; i++)
+        fprintf(stderr, "[i3lock] startup: %-12s %8.2f ms %4u round-trips\n",
+                phases[i].name, phases[i].duration * 1000, phases[i].round_trips);
+    fprintf(stderr, "[i3lock] startup: %-12s %8.2f ms %4u round-trips (total)\n",
+            milestone, (ev_time() - started) * 1000, round_trips);
+    num_phases = 0;
+
+    if (last)
+        trace_startup = false;
+}
@@ -0,0 +1,9 @@
+#ifndef _TRACE_H
+#define _TRACE_H
+
+void trace_start(void);
+void trace_phase(const char *name);
+void trace_round_trips(unsigned int n);
+void trace_report(const char *milestone, bool last);
+
+#endif
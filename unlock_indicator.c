@@ -20,6 +20,8 @@
 #include "xcb.h"
 #include "unlock_indicator.h"
 #include "klok.h"
+#include "background.h"
+#include "animation.h"
 #include "xinerama.h"
 
 #define BUTTON_RADIUS 90
@@ -49,11 +51,6 @@ extern bool unlock_indicator;
 /* List of pressed modifiers, or NULL if none are pressed. */
 extern char *modifier_string;
 
-/* A Cairo surface containing the specified image (-i), if any. */
-extern cairo_surface_t *img;
-
-/* Whether the image should be tiled. */
-extern bool tile;
 /* The background color to use (in hex). */
 extern char color[7];
 
@@ -64,6 +61,9 @@ extern int failed_attempts;
 
 extern bool klok_mode;
 
+/* Whether each output gets its own background pixmap. */
+extern bool per_output_pixmaps;
+
 
 /*******************************************************************************
  * Variables defined in xcb.c.
@@ -79,6 +79,26 @@ extern xcb_screen_t *screen;
 /* Cache the screen’s visual, necessary for creating a Cairo context. */
 static xcb_visualtype_t *vistype;
 
+/* Klok and unlock indicator, kept separately from the background while an
+ * animation is running. NULL when there is nothing to show. */
+static cairo_surface_t *overlay;
+
+/* A window’s background pixmap, which is drawn into again as long as the size
+ * stays the same (e.g. for every animation frame). */
+struct bg_pixmap {
+    xcb_pixmap_t id;
+    uint16_t width;
+    uint16_t height;
+};
+
+/* The background pixmap of the lock window, also kept to redraw parts of it. */
+static struct bg_pixmap win_pixmap;
+
+/* The child windows covering each output, with --per-output-pixmaps. */
+static xcb_window_t *output_wins;
+static struct bg_pixmap *output_pixmaps;
+static int num_output_wins;
+
 /* Maintain the current unlock/PAM state to draw the appropriate unlock
  * indicator. */
 unlock_state_t unlock_state;
@@ -96,54 +116,20 @@ static double scaling_factor(void) {
 }
 
 /*
- * Draws global image with fill color onto a pixmap with the given
- * resolution and returns it.
+ * Draws the klok (if enabled) and the unlock indicator onto the given context.
  *
  */
-xcb_pixmap_t draw_image(uint32_t *resolution) {
-    xcb_pixmap_t bg_pixmap = XCB_NONE;
+static void draw_overlay(cairo_t *xcb_ctx, uint32_t *resolution) {
     int button_diameter_physical = ceil(scaling_factor() * BUTTON_DIAMETER);
     DEBUG("scaling_factor is %.f, physical diameter is %d px\n",
           scaling_factor(), button_diameter_physical);
 
-    if (!vistype)
-        vistype = get_root_visual_type(screen);
-    bg_pixmap = create_bg_pixmap(conn, screen, resolution, color);
-    /* Initialize cairo: Create one in-memory surface to render the unlock
-     * indicator on, create one XCB surface to actually draw (one or more,
-     * depending on the amount of screens) unlock indicators on. */
+    /* Create one in-memory surface to render the unlock indicator on, which
+     * is then composited (one or more times, depending on the amount of
+     * screens) onto xcb_ctx. */
     cairo_surface_t *output = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, button_diameter_physical, button_diameter_physical);
     cairo_t *ctx = cairo_create(output);
 
-    cairo_surface_t *xcb_output = cairo_xcb_surface_create(conn, bg_pixmap, vistype, resolution[0], resolution[1]);
-    cairo_t *xcb_ctx = cairo_create(xcb_output);
-
-    if (img) {
-        if (!tile) {
-            cairo_set_source_surface(xcb_ctx, img, 0, 0);
-            cairo_paint(xcb_ctx);
-        } else {
-            /* create a pattern and fill a rectangle as big as the screen */
-            cairo_pattern_t *pattern;
-            pattern = cairo_pattern_create_for_surface(img);
-            cairo_set_source(xcb_ctx, pattern);
-            cairo_pattern_set_extend(pattern, CAIRO_EXTEND_REPEAT);
-            cairo_rectangle(xcb_ctx, 0, 0, resolution[0], resolution[1]);
-            cairo_fill(xcb_ctx);
-            cairo_pattern_destroy(pattern);
-        }
-    } else {
-        char strgroups[3][3] = {{color[0], color[1], '\0'},
-                                {color[2], color[3], '\0'},
-                                {color[4], color[5], '\0'}};
-        uint32_t rgb16[3] = {(strtol(strgroups[0], NULL, 16)),
-                             (strtol(strgroups[1], NULL, 16)),
-                             (strtol(strgroups[2], NULL, 16))};
-        cairo_set_source_rgb(xcb_ctx, rgb16[0] / 255.0, rgb16[1] / 255.0, rgb16[2] / 255.0);
-        cairo_rectangle(xcb_ctx, 0, 0, resolution[0], resolution[1]);
-        cairo_fill(xcb_ctx);
-    }
-
     if (klok_mode) {
         draw_klok(xcb_ctx, resolution[0], resolution[1]);
     }
@@ -319,25 +305,264 @@ xcb_pixmap_t draw_image(uint32_t *resolution) {
         cairo_fill(xcb_ctx);
     }
 
-    cairo_surface_destroy(xcb_output);
     cairo_surface_destroy(output);
     cairo_destroy(ctx);
+}
+
+/*
+ * Renders klok and unlock indicator into the overlay surface, or drops it when
+ * there is nothing to show.
+ *
+ */
+static void update_overlay(uint32_t *resolution) {
+    bool indicator_visible = (unlock_indicator &&
+                              (unlock_state >= STATE_KEY_PRESSED || pam_state > STATE_PAM_IDLE));
+
+    if (!klok_mode && !indicator_visible) {
+        if (overlay != NULL)
+            cairo_surface_destroy(overlay);
+        overlay = NULL;
+        return;
+    }
+
+    if (overlay == NULL ||
+        cairo_image_surface_get_width(overlay) != resolution[0] ||
+        cairo_image_surface_get_height(overlay) != resolution[1]) {
+        if (overlay != NULL)
+            cairo_surface_destroy(overlay);
+        overlay = cairo_image_surface_create(CAIRO_FORMAT_ARGB32, resolution[0], resolution[1]);
+    }
+
+    cairo_t *ctx = cairo_create(overlay);
+    cairo_set_operator(ctx, CAIRO_OPERATOR_CLEAR);
+    cairo_paint(ctx);
+    cairo_set_operator(ctx, CAIRO_OPERATOR_OVER);
+    draw_overlay(ctx, resolution);
+    cairo_destroy(ctx);
+}
+
+/*
+ * Whether the outputs are covered by their own child windows, each with a
+ * background pixmap of the output’s size, instead of one pixmap covering the
+ * bounding box of all outputs.
+ *
+ */
+bool use_output_windows(void) {
+    return per_output_pixmaps && xr_screens > 0;
+}
+
+/*
+ * Whether klok and unlock indicator are kept in a separate layer, so that
+ * presenting an animation frame only has to redraw the background, see
+ * redraw_background(). Not used with per-output pixmaps, where a layer of the
+ * bounding box size would defeat the purpose.
+ *
+ */
+static bool use_overlay_layer(void) {
+    return animation_running() && !use_output_windows();
+}
+
+/*
+ * Draws the given area of the root window onto a pixmap of the area’s size,
+ * which is filled with the background color. When cached_overlay is true, the
+ * overlay surface is used instead of drawing klok and unlock indicator.
+ *
+ */
+static void draw_area(xcb_pixmap_t bg_pixmap, uint32_t *resolution, Rect *area, bool cached_overlay) {
+    uint32_t size[2] = {area->width, area->height};
+
+    if (!vistype)
+        vistype = get_root_visual_type(screen);
+
+    cairo_surface_t *xcb_output = cairo_xcb_surface_create(conn, bg_pixmap, vistype, size[0], size[1]);
+    cairo_t *xcb_ctx = cairo_create(xcb_output);
+
+    /* Everything below is drawn in root window coordinates. */
+    cairo_translate(xcb_ctx, -area->x, -area->y);
+
+    draw_background(xcb_ctx, resolution);
+    if (!cached_overlay) {
+        draw_overlay(xcb_ctx, resolution);
+    } else if (overlay != NULL) {
+        cairo_set_source_surface(xcb_ctx, overlay, 0, 0);
+        cairo_paint(xcb_ctx);
+    }
+
+    cairo_surface_destroy(xcb_output);
     cairo_destroy(xcb_ctx);
+}
+
+/*
+ * Draws global image with fill color onto a pixmap with the given
+ * resolution and returns it.
+ *
+ */
+xcb_pixmap_t draw_image(uint32_t *resolution) {
+    Rect area = {0, 0, resolution[0], resolution[1]};
+
+    if (use_overlay_layer())
+        update_overlay(resolution);
+
+    xcb_pixmap_t bg_pixmap = create_bg_pixmap(conn, screen, resolution, color);
+    draw_area(bg_pixmap, resolution, &area, use_overlay_layer());
     return bg_pixmap;
 }
 
+/*
+ * Returns the given window’s background pixmap, filled with the background
+ * color. A new pixmap is only created when the size changed.
+ *
+ */
+static xcb_pixmap_t prepare_bg_pixmap(struct bg_pixmap *bg, uint16_t width, uint16_t height) {
+    uint32_t size[2] = {width, height};
+
+    if (bg->id != XCB_NONE && bg->width == width && bg->height == height) {
+        fill_bg_pixmap(conn, screen, bg->id, size, color);
+        return bg->id;
+    }
+
+    if (bg->id != XCB_NONE)
+        xcb_free_pixmap(conn, bg->id);
+    bg->id = create_bg_pixmap(conn, screen, size, color);
+    bg->width = width;
+    bg->height = height;
+    return bg->id;
+}
+
+static void free_bg_pixmap(struct bg_pixmap *bg) {
+    if (bg->id != XCB_NONE)
+        xcb_free_pixmap(conn, bg->id);
+    bg->id = XCB_NONE;
+}
+
+/*
+ * Makes the given pixmap the background of the given window.
+ *
+ */
+static void show_pixmap(xcb_window_t window, xcb_pixmap_t bg_pixmap, uint16_t width, uint16_t height) {
+    xcb_change_window_attributes(conn, window, XCB_CW_BACK_PIXMAP, (uint32_t[1]){bg_pixmap});
+    /* XXX: Possible optimization: Only update the area in the middle of the
+     * screen instead of the whole screen. */
+    xcb_clear_area(conn, 0, window, 0, 0, width, height);
+}
+
+/*
+ * Creates, moves or destroys the per-output child windows so that there is
+ * one for each Xinerama screen (or none, without per-output pixmaps).
+ *
+ */
+static void sync_output_windows(void) {
+    int wanted = (use_output_windows() ? xr_screens : 0);
+
+    for (int i = wanted; i < num_output_wins; i++) {
+        xcb_destroy_window(conn, output_wins[i]);
+        free_bg_pixmap(&output_pixmaps[i]);
+    }
+
+    if (wanted > num_output_wins) {
+        xcb_window_t *wins = realloc(output_wins, wanted * sizeof(xcb_window_t));
+        if (wins != NULL)
+            output_wins = wins;
+        struct bg_pixmap *pixmaps = realloc(output_pixmaps, wanted * sizeof(struct bg_pixmap));
+        if (pixmaps != NULL)
+            output_pixmaps = pixmaps;
+        if (wins == NULL || pixmaps == NULL)
+            wanted = num_output_wins;
+        else
+            memset(&output_pixmaps[num_output_wins], 0, (wanted - num_output_wins) * sizeof(struct bg_pixmap));
+    }
+
+    for (int i = 0; i < wanted; i++) {
+        Rect *r = &xr_resolutions[i];
+        if (i >= num_output_wins) {
+            output_wins[i] = open_output_window(conn, win, r->x, r->y, r->width, r->height);
+        } else {
+            uint32_t values[] = {r->x, r->y, r->width, r->height};
+            xcb_configure_window(conn, output_wins[i],
+                                 XCB_CONFIG_WINDOW_X | XCB_CONFIG_WINDOW_Y |
+                                     XCB_CONFIG_WINDOW_WIDTH | XCB_CONFIG_WINDOW_HEIGHT,
+                                 values);
+        }
+    }
+    num_output_wins = wanted;
+}
+
+/*
+ * Draws and shows the background pixmaps of the lock window, or of each
+ * output window.
+ *
+ */
+static void update_windows(bool cached_overlay) {
+    sync_output_windows();
+
+    if (num_output_wins == 0) {
+        Rect area = {0, 0, last_resolution[0], last_resolution[1]};
+        xcb_pixmap_t bg_pixmap = prepare_bg_pixmap(&win_pixmap, area.width, area.height);
+        draw_area(bg_pixmap, last_resolution, &area, cached_overlay);
+        show_pixmap(win, bg_pixmap, area.width, area.height);
+    } else {
+        free_bg_pixmap(&win_pixmap);
+    }
+    for (int i = 0; i < num_output_wins; i++) {
+        Rect *area = &xr_resolutions[i];
+        xcb_pixmap_t bg_pixmap = prepare_bg_pixmap(&output_pixmaps[i], area->width, area->height);
+        draw_area(bg_pixmap, last_resolution, area, cached_overlay);
+        show_pixmap(output_wins[i], bg_pixmap, area->width, area->height);
+    }
+    xcb_flush(conn);
+}
+
 /*
  * Calls draw_image on a new pixmap and swaps that with the current pixmap
  *
  */
 void redraw_screen(void) {
     DEBUG("redraw_screen(unlock_state = %d, pam_state = %d)\n", unlock_state, pam_state);
-    xcb_pixmap_t bg_pixmap = draw_image(last_resolution);
-    xcb_change_window_attributes(conn, win, XCB_CW_BACK_PIXMAP, (uint32_t[1]){bg_pixmap});
-    /* XXX: Possible optimization: Only update the area in the middle of the
-     * screen instead of the whole screen. */
-    xcb_clear_area(conn, 0, win, 0, 0, last_resolution[0], last_resolution[1]);
-    xcb_free_pixmap(conn, bg_pixmap);
+    if (use_overlay_layer())
+        update_overlay(last_resolution);
+    update_windows(use_overlay_layer());
+}
+
+/*
+ * Redraws only the background beneath the unchanged klok and unlock
+ * indicator. Used to present animation frames.
+ *
+ */
+void redraw_background(void) {
+    update_windows(use_overlay_layer());
+}
+
+/*
+ * Redraws only the given areas (in root window coordinates) of the lock
+ * window, e.g. the words of the klok which changed, and exposes just these.
+ * Falls back to redraw_screen() when the lock window has no pixmap of its own
+ * or klok and unlock indicator live in a separate layer.
+ *
+ */
+void redraw_areas(xcb_rectangle_t *areas, int n) {
+    if (win_pixmap.id == XCB_NONE || use_output_windows() || use_overlay_layer()) {
+        redraw_screen();
+        return;
+    }
+
+    cairo_surface_t *xcb_output = cairo_xcb_surface_create(conn, win_pixmap.id, vistype, last_resolution[0], last_resolution[1]);
+    cairo_t *xcb_ctx = cairo_create(xcb_output);
+
+    for (int i = 0; i < n; i++)
+        cairo_rectangle(xcb_ctx, areas[i].x, areas[i].y, areas[i].width, areas[i].height);
+    cairo_clip(xcb_ctx);
+
+    draw_background(xcb_ctx, last_resolution);
+    draw_overlay(xcb_ctx, last_resolution);
+
+    cairo_surface_destroy(xcb_output);
+    cairo_destroy(xcb_ctx);
+
+    /* The X server may have copied the pixmap when it was set as background,
+     * so set it again before exposing the changed areas. */
+    xcb_change_window_attributes(conn, win, XCB_CW_BACK_PIXMAP, (uint32_t[1]){win_pixmap.id});
+    for (int i = 0; i < n; i++)
+        xcb_clear_area(conn, 0, win, areas[i].x, areas[i].y, areas[i].width, areas[i].height);
     xcb_flush(conn);
 }
 
@@ -17,7 +17,10 @@ typedef enum {
 } pam_state_t;
 
 xcb_pixmap_t draw_image(uint32_t* resolution);
+bool use_output_windows(void);
 void redraw_screen(void);
+void redraw_background(void);
+void redraw_areas(xcb_rectangle_t *areas, int n);
 void clear_indicator(void);
 
 #endif
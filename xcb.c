@@ -10,7 +10,8 @@
 #include <xcb/xcb.h>
 #include <xcb/xcb_image.h>
 #include <xcb/xcb_atom.h>
-#include <xcb/xcb_aux.h>
+#include <xcb/dpms.h>
+#include <xcb/xcbext.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -20,6 +21,8 @@
 #include <err.h>
 
 #include "cursors.h"
+#include "xcb.h"
+#include "trace.h"
 
 xcb_connection_t *conn;
 xcb_screen_t *screen;
@@ -48,15 +51,40 @@ static unsigned char mask_windows_bits[] = {
     0xf7, 0x00, 0xf3, 0x00, 0xe1, 0x01, 0xe0, 0x01, 0xc0, 0x03, 0xc0, 0x03,
     0x80, 0x01};
 
-static uint32_t get_colorpixel(char *hex) {
+/*
+ * Converts the given hex color (rrggbb) to a pixel value of the root visual.
+ * The channel shifts and widths are computed once, so that e.g. RGB565
+ * (16-bit) and 10 bits per channel (30-bit) displays get the right color.
+ *
+ */
+static uint32_t get_colorpixel(xcb_screen_t *scr, char *hex) {
+    static xcb_visualid_t cached_visual = XCB_NONE;
+    static int shift[3] = {16, 8, 0};
+    static int bits[3] = {8, 8, 8};
+
+    if (cached_visual != scr->root_visual) {
+        xcb_visualtype_t *visual = get_root_visual_type(scr);
+        cached_visual = scr->root_visual;
+        if (visual != NULL && visual->_class == XCB_VISUAL_CLASS_TRUE_COLOR) {
+            uint32_t masks[3] = {visual->red_mask, visual->green_mask, visual->blue_mask};
+            for (int c = 0; c < 3; c++) {
+                shift[c] = __builtin_ctz(masks[c]);
+                bits[c] = __builtin_popcount(masks[c]);
+            }
+        }
+    }
+
     char strgroups[3][3] = {{hex[0], hex[1], '\0'},
                             {hex[2], hex[3], '\0'},
                             {hex[4], hex[5], '\0'}};
-    uint32_t rgb16[3] = {(strtol(strgroups[0], NULL, 16)),
-                         (strtol(strgroups[1], NULL, 16)),
-                         (strtol(strgroups[2], NULL, 16))};
+    uint32_t pixel = 0;
+    for (int c = 0; c < 3; c++) {
+        uint32_t value = strtol(strgroups[c], NULL, 16);
+        uint32_t max = (1 << bits[c]) - 1;
+        pixel |= ((value * max + 127) / 255) << shift[c];
+    }
 
-    return (rgb16[0] << 16) + (rgb16[1] << 8) + rgb16[2];
+    return pixel;
 }
 
 xcb_visualtype_t *get_root_visual_type(xcb_screen_t *screen) {
@@ -81,19 +109,22 @@ xcb_visualtype_t *get_root_visual_type(xcb_screen_t *screen) {
     return NULL;
 }
 
-xcb_pixmap_t create_bg_pixmap(xcb_connection_t *conn, xcb_screen_t *scr, u_int32_t *resolution, char *color) {
-    xcb_pixmap_t bg_pixmap = xcb_generate_id(conn);
-    xcb_create_pixmap(conn, scr->root_depth, bg_pixmap, scr->root,
-                      resolution[0], resolution[1]);
-
+void fill_bg_pixmap(xcb_connection_t *conn, xcb_screen_t *scr, xcb_pixmap_t bg_pixmap, u_int32_t *resolution, char *color) {
     /* Generate a Graphics Context and fill the pixmap with background color
      * (for images that are smaller than your screen) */
     xcb_gcontext_t gc = xcb_generate_id(conn);
-    uint32_t values[] = {get_colorpixel(color)};
+    uint32_t values[] = {get_colorpixel(scr, color)};
     xcb_create_gc(conn, gc, bg_pixmap, XCB_GC_FOREGROUND, values);
     xcb_rectangle_t rect = {0, 0, resolution[0], resolution[1]};
     xcb_poly_fill_rectangle(conn, bg_pixmap, gc, 1, &rect);
     xcb_free_gc(conn, gc);
+}
+
+xcb_pixmap_t create_bg_pixmap(xcb_connection_t *conn, xcb_screen_t *scr, u_int32_t *resolution, char *color) {
+    xcb_pixmap_t bg_pixmap = xcb_generate_id(conn);
+    xcb_create_pixmap(conn, scr->root_depth, bg_pixmap, scr->root,
+                      resolution[0], resolution[1]);
+    fill_bg_pixmap(conn, scr, bg_pixmap, resolution, color);
 
     return bg_pixmap;
 }
@@ -105,7 +136,7 @@ xcb_window_t open_fullscreen_window(xcb_connection_t *conn, xcb_screen_t *scr, c
 
     if (pixmap == XCB_NONE) {
         mask |= XCB_CW_BACK_PIXEL;
-        values[0] = get_colorpixel(color);
+        values[0] = get_colorpixel(scr, color);
     } else {
         mask |= XCB_CW_BACK_PIXMAP;
         values[0] = pixmap;
@@ -151,68 +182,127 @@ xcb_window_t open_fullscreen_window(xcb_connection_t *conn, xcb_screen_t *scr, c
     values[0] = XCB_STACK_MODE_ABOVE;
     xcb_configure_window(conn, win, XCB_CONFIG_WINDOW_STACK_MODE, values);
 
-    /* Ensure that the window is created and set up before returning */
-    xcb_aux_sync(conn);
+    /* Requests are processed in order, so there is no need to wait for the
+     * window to be set up before using it (or grabbing input). */
+    xcb_flush(conn);
+
+    return win;
+}
+
+/*
+ * Opens a child window of the lock window covering one output. Its background
+ * pixmap is set later on, until then the lock window shines through.
+ *
+ */
+xcb_window_t open_output_window(xcb_connection_t *conn, xcb_window_t parent, int16_t x, int16_t y, uint16_t width, uint16_t height) {
+    xcb_window_t win = xcb_generate_id(conn);
+
+    xcb_create_window(conn,
+                      XCB_COPY_FROM_PARENT,
+                      win,
+                      parent,
+                      x, y,
+                      width, height,
+                      0,
+                      XCB_WINDOW_CLASS_INPUT_OUTPUT,
+                      XCB_WINDOW_CLASS_COPY_FROM_PARENT,
+                      XCB_CW_BACK_PIXMAP,
+                      (uint32_t[]){XCB_BACK_PIXMAP_PARENT_RELATIVE});
+    xcb_map_window(conn, win);
 
     return win;
 }
 
 /*
- * Repeatedly tries to grab pointer and keyboard (up to 1000 times).
+ * Tries to grab pointer and keyboard once. Both requests are sent before
+ * waiting for either reply, so this costs one round-trip. Returns true if
+ * both grabs are held; otherwise, neither is.
  *
  */
-void grab_pointer_and_keyboard(xcb_connection_t *conn, xcb_screen_t *screen, xcb_cursor_t cursor) {
+bool grab_pointer_and_keyboard(xcb_connection_t *conn, xcb_screen_t *screen, xcb_cursor_t cursor) {
     xcb_grab_pointer_cookie_t pcookie;
     xcb_grab_pointer_reply_t *preply;
 
     xcb_grab_keyboard_cookie_t kcookie;
     xcb_grab_keyboard_reply_t *kreply;
 
-    int tries = 10000;
-
-    while (tries-- > 0) {
-        pcookie = xcb_grab_pointer(
-            conn,
-            false,               /* get all pointer events specified by the following mask */
-            screen->root,        /* grab the root window */
-            XCB_NONE,            /* which events to let through */
-            XCB_GRAB_MODE_ASYNC, /* pointer events should continue as normal */
-            XCB_GRAB_MODE_ASYNC, /* keyboard mode */
-            XCB_NONE,            /* confine_to = in which window should the cursor stay */
-            cursor,              /* we change the cursor to whatever the user wanted */
-            XCB_CURRENT_TIME);
-
-        if ((preply = xcb_grab_pointer_reply(conn, pcookie, NULL)) &&
-            preply->status == XCB_GRAB_STATUS_SUCCESS) {
-            free(preply);
-            break;
-        }
+    bool grabbed;
+
+    pcookie = xcb_grab_pointer(
+        conn,
+        false,               /* get all pointer events specified by the following mask */
+        screen->root,        /* grab the root window */
+        XCB_NONE,            /* which events to let through */
+        XCB_GRAB_MODE_ASYNC, /* pointer events should continue as normal */
+        XCB_GRAB_MODE_ASYNC, /* keyboard mode */
+        XCB_NONE,            /* confine_to = in which window should the cursor stay */
+        cursor,              /* we change the cursor to whatever the user wanted */
+        XCB_CURRENT_TIME);
+
+    kcookie = xcb_grab_keyboard(
+        conn,
+        true,         /* report events */
+        screen->root, /* grab the root window */
+        XCB_CURRENT_TIME,
+        XCB_GRAB_MODE_ASYNC, /* process events as normal, do not require sync */
+        XCB_GRAB_MODE_ASYNC);
+
+    preply = xcb_grab_pointer_reply(conn, pcookie, NULL);
+    kreply = xcb_grab_keyboard_reply(conn, kcookie, NULL);
+    trace_round_trips(1);
+
+    bool pointer = (preply && preply->status == XCB_GRAB_STATUS_SUCCESS);
+    bool keyboard = (kreply && kreply->status == XCB_GRAB_STATUS_SUCCESS);
+    free(preply);
+    free(kreply);
+
+    /* Don’t hold on to half of the input while retrying: e.g. keeping the
+     * keyboard while a menu holds the pointer would leave both stuck. */
+    grabbed = (pointer && keyboard);
+    if (!grabbed && pointer)
+        xcb_ungrab_pointer(conn, XCB_CURRENT_TIME);
+    if (!grabbed && keyboard)
+        xcb_ungrab_keyboard(conn, XCB_CURRENT_TIME);
+    return grabbed;
+}
 
-        /* Make this quite a bit slower */
-        usleep(50);
-    }
+/*
+ * Asks the X server whether the display is on, see dpms_poll_off. Returns a
+ * cookie with sequence 0 when DPMS is not supported.
+ *
+ */
+xcb_dpms_info_cookie_t dpms_query(xcb_connection_t *conn) {
+    xcb_dpms_info_cookie_t cookie = {0};
 
-    while (tries-- > 0) {
-        kcookie = xcb_grab_keyboard(
-            conn,
-            true,         /* report events */
-            screen->root, /* grab the root window */
-            XCB_CURRENT_TIME,
-            XCB_GRAB_MODE_ASYNC, /* process events as normal, do not require sync */
-            XCB_GRAB_MODE_ASYNC);
-
-        if ((kreply = xcb_grab_keyboard_reply(conn, kcookie, NULL)) &&
-            kreply->status == XCB_GRAB_STATUS_SUCCESS) {
-            free(kreply);
-            break;
-        }
+    if (!xcb_get_extension_data(conn, &xcb_dpms_id)->present)
+        return cookie;
 
-        /* Make this quite a bit slower */
-        usleep(50);
-    }
+    cookie = xcb_dpms_info(conn);
+    xcb_flush(conn);
+    return cookie;
+}
+
+/*
+ * Returns 1 if DPMS is enabled and the display is currently not on, 0 if it is
+ * on, or -1 if the reply to dpms_query did not arrive yet. Never waits for
+ * the X server.
+ *
+ */
+int dpms_poll_off(xcb_connection_t *conn, xcb_dpms_info_cookie_t cookie) {
+    xcb_dpms_info_reply_t *reply = NULL;
+    xcb_generic_error_t *error = NULL;
+    int off;
+
+    if (!xcb_poll_for_reply(conn, cookie.sequence, (void **)&reply, &error))
+        return -1;
+
+    free(error);
+    if (reply == NULL)
+        return 0;
 
-    if (tries <= 0)
-        errx(EXIT_FAILURE, "Cannot grab pointer/keyboard");
+    off = (reply->state && reply->power_level != XCB_DPMS_DPMS_MODE_ON);
+    free(reply);
+    return off;
 }
 
 xcb_cursor_t create_cursor(xcb_connection_t *conn, xcb_screen_t *screen, xcb_window_t win, int choice) {
@@ -8,10 +8,14 @@ extern xcb_connection_t *conn;
 extern xcb_screen_t *screen;
 
 xcb_visualtype_t *get_root_visual_type(xcb_screen_t *s);
+void fill_bg_pixmap(xcb_connection_t *conn, xcb_screen_t *scr, xcb_pixmap_t bg_pixmap, u_int32_t *resolution, char *color);
 xcb_pixmap_t create_bg_pixmap(xcb_connection_t *conn, xcb_screen_t *scr, u_int32_t *resolution, char *color);
 xcb_window_t open_fullscreen_window(xcb_connection_t *conn, xcb_screen_t *scr, char *color, xcb_pixmap_t pixmap);
-void grab_pointer_and_keyboard(xcb_connection_t *conn, xcb_screen_t *screen, xcb_cursor_t cursor);
+xcb_window_t open_output_window(xcb_connection_t *conn, xcb_window_t parent, int16_t x, int16_t y, uint16_t width, uint16_t height);
+bool grab_pointer_and_keyboard(xcb_connection_t *conn, xcb_screen_t *screen, xcb_cursor_t cursor);
 void dpms_set_mode(xcb_connection_t *conn, xcb_dpms_dpms_mode_t mode);
+xcb_dpms_info_cookie_t dpms_query(xcb_connection_t *conn);
+int dpms_poll_off(xcb_connection_t *conn, xcb_dpms_info_cookie_t cookie);
 xcb_cursor_t create_cursor(xcb_connection_t *conn, xcb_screen_t *screen, xcb_window_t win, int choice);
 
 #endif
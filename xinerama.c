@@ -9,13 +9,16 @@
 #include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
 #include <xcb/xcb.h>
 #include <xcb/xinerama.h>
+#include <xcb/randr.h>
 
 #include "i3lock.h"
 #include "xcb.h"
 #include "xinerama.h"
+#include "trace.h"
 
 /* Number of Xinerama screens which are currently present. */
 int xr_screens = 0;
@@ -23,9 +26,75 @@ int xr_screens = 0;
 /* The resolutions of the currently present Xinerama screens. */
 Rect *xr_resolutions;
 
+/* The RandR names of the currently present Xinerama screens (entries are NULL
+ * when unknown, e.g. without RandR 1.5, or when xr_want_names is not set). */
+char **xr_names;
+
+/* Whether xr_names is needed (an --image-output refers to an output by name).
+ * Looking the names up costs an additional round-trip. */
+bool xr_want_names;
+
 static bool xinerama_active;
+static bool randr_monitors_supported;
 extern bool debug_mode;
 
+/*
+ * Fills xr_names by matching the geometry of the RandR monitors against the
+ * Xinerama screens. The monitor names are atoms, looking them up takes one
+ * more round-trip.
+ *
+ */
+static void query_monitor_names(xcb_randr_get_monitors_cookie_t cookie) {
+    xcb_randr_get_monitors_reply_t *reply;
+    xcb_randr_monitor_info_iterator_t iter;
+
+    reply = xcb_randr_get_monitors_reply(conn, cookie, NULL);
+    if (!reply)
+        return;
+
+    int monitors = xcb_randr_get_monitors_monitors_length(reply);
+    xcb_randr_monitor_info_t *infos[monitors];
+    xcb_get_atom_name_cookie_t cookies[monitors];
+
+    /* Send all atom name requests before waiting for the first reply. */
+    int m = 0;
+    for (iter = xcb_randr_get_monitors_monitors_iterator(reply); iter.rem; xcb_randr_monitor_info_next(&iter)) {
+        infos[m] = iter.data;
+        cookies[m++] = xcb_get_atom_name(conn, iter.data->name);
+    }
+    if (monitors > 0)
+        trace_round_trips(1);
+
+    for (m = 0; m < monitors; m++) {
+        xcb_get_atom_name_reply_t *name_reply = xcb_get_atom_name_reply(conn, cookies[m], NULL);
+        if (!name_reply)
+            continue;
+
+        for (int screen = 0; screen < xr_screens; screen++) {
+            if (xr_names[screen] != NULL ||
+                xr_resolutions[screen].x != infos[m]->x ||
+                xr_resolutions[screen].y != infos[m]->y ||
+                xr_resolutions[screen].width != infos[m]->width ||
+                xr_resolutions[screen].height != infos[m]->height)
+                continue;
+
+            xr_names[screen] = strndup(xcb_get_atom_name_name(name_reply),
+                                       xcb_get_atom_name_name_length(name_reply));
+            DEBUG("Xinerama screen %d is output %s\n", screen, xr_names[screen]);
+            break;
+        }
+        free(name_reply);
+    }
+
+    free(reply);
+}
+
+/*
+ * Checks whether Xinerama is active and whether the server supports RandR
+ * monitors (RandR 1.5), which we use to find out the output names of the
+ * Xinerama screens. Both requests are sent before waiting for the replies.
+ *
+ */
 void xinerama_init(void) {
     if (!xcb_get_extension_data(conn, &xcb_xinerama_id)->present) {
         DEBUG("Xinerama extension not found, disabling.\n");
@@ -34,18 +103,28 @@ void xinerama_init(void) {
 
     xcb_xinerama_is_active_cookie_t cookie;
     xcb_xinerama_is_active_reply_t *reply;
+    xcb_randr_query_version_cookie_t randr_cookie = {0};
+    xcb_randr_query_version_reply_t *randr_reply = NULL;
+    bool randr_present = xcb_get_extension_data(conn, &xcb_randr_id)->present;
 
     cookie = xcb_xinerama_is_active(conn);
+    if (randr_present)
+        randr_cookie = xcb_randr_query_version(conn, 1, 5);
+
     reply = xcb_xinerama_is_active_reply(conn, cookie, NULL);
-    if (!reply)
-        return;
+    if (randr_present)
+        randr_reply = xcb_randr_query_version_reply(conn, randr_cookie, NULL);
+    trace_round_trips(1);
 
-    if (!reply->state) {
-        free(reply);
-        return;
+    if (randr_reply) {
+        randr_monitors_supported = (randr_reply->major_version > 1 || randr_reply->minor_version >= 5);
+        free(randr_reply);
     }
 
-    xinerama_active = true;
+    if (!reply)
+        return;
+
+    xinerama_active = reply->state;
     free(reply);
 }
 
@@ -57,9 +136,21 @@ void xinerama_query_screens(void) {
     xcb_xinerama_query_screens_reply_t *reply;
     xcb_xinerama_screen_info_t *screen_info;
 
+    xcb_randr_get_monitors_cookie_t monitors_cookie = {0};
+    const bool names = (randr_monitors_supported && xr_want_names);
+
+    /* The RandR monitors are only needed for their names. They are asked for
+     * right away, so that the screens and the monitors arrive in the same
+     * round-trip (their names do not, see query_monitor_names). */
     cookie = xcb_xinerama_query_screens_unchecked(conn);
+    if (names)
+        monitors_cookie = xcb_randr_get_monitors(conn, screen->root, true);
+
     reply = xcb_xinerama_query_screens_reply(conn, cookie, NULL);
+    trace_round_trips(1);
     if (!reply) {
+        if (names)
+            xcb_discard_reply(conn, monitors_cookie.sequence);
         if (debug_mode)
             fprintf(stderr, "Couldn't get Xinerama screens\n");
         return;
@@ -68,12 +159,22 @@ void xinerama_query_screens(void) {
     int screens = xcb_xinerama_query_screens_screen_info_length(reply);
 
     Rect *resolutions = malloc(screens * sizeof(Rect));
+    char **screen_names = calloc(screens, sizeof(char *));
     /* No memory? Just keep on using the old information. */
-    if (!resolutions) {
+    if (!resolutions || !screen_names) {
+        free(resolutions);
+        free(screen_names);
         free(reply);
+        if (names)
+            xcb_discard_reply(conn, monitors_cookie.sequence);
         return;
     }
+    for (int screen = 0; screen < xr_screens; screen++)
+        free(xr_names[screen]);
+    free(xr_names);
+    free(xr_resolutions);
     xr_resolutions = resolutions;
+    xr_names = screen_names;
     xr_screens = screens;
 
     for (int screen = 0; screen < xr_screens; screen++) {
@@ -87,4 +188,7 @@ void xinerama_query_screens(void) {
     }
 
     free(reply);
+
+    if (names)
+        query_monitor_names(monitors_cookie);
 }
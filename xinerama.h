@@ -10,6 +10,8 @@ typedef struct Rect {
 
 extern int xr_screens;
 extern Rect *xr_resolutions;
+extern char **xr_names;
+extern bool xr_want_names;
 
 void xinerama_init(void);
 void xinerama_query_screens(void);